@@ -0,0 +1,321 @@
+//
+//  bench.c
+//  test_server
+//
+//  Microbenchmarks for the request path helpers in main.c.
+//
+/*
+ * FILE: bench.c
+ *
+ * Description: Pulls main.c in as a library (its main() is compiled out)
+ * and times the hot helpers in a tight loop, printing ns per call so a
+ * change can be compared against the baseline it replaces.
+ *
+ * Build: cmake -S . -B build && cmake --build build      (from the repository root)
+ * Usage: ./bench [iterations]   (the request benchmark runs iterations/10 times)
+ */
+
+#define TEST_SERVER_NO_MAIN
+#include "main.c"
+
+// a typical browser request: 13 header lines, ~700 bytes
+static const char browser_request[] =
+    "GET /static/css/site.min.css?v=20160413 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; tz=America%2FNew_York\r\n"
+    "\r\n";
+
+volatile long sink;     // keeps the optimizer from dropping the measured work
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// time iters calls of fn and print the per-call cost; returns ns per call
+static double bench_run(const char *name, void (*fn)(void), long iters){
+    double start, ns;
+    long i;
+    for (i = 0; i < iters / 10; i++)     // warm caches and branch predictors
+        fn();
+    start = now_ns();
+    for (i = 0; i < iters; i++)
+        fn();
+    ns = (now_ns() - start) / iters;
+    printf("%-40s %10.1f ns/op\n", name, ns);
+    return ns;
+}
+
+/*
+ *    The request head loop as it was before http_parse_head(): one
+ *    rio_read() per byte through rio_readlineb(), three memsets and a
+ *    hand copy of the header name per line, sscanf for the request line.
+ *    The rio buffer is pre-filled so no read() is ever issued.
+ */
+static void parse_rio_baseline(void){
+    rio_t rd;
+    char buffer[MAXLINE], method[MAXLINE], url[MAXLINE];
+    char request_head[50];
+    char browser[20];
+    int browser_index = 0;
+    ssize_t n;
+
+    rio_readinitb(&rd, -1);
+    memcpy(rd.rio_buf, browser_request, sizeof(browser_request) - 1);
+    rd.rio_cnt = sizeof(browser_request) - 1;
+
+    rio_readlineb(&rd, buffer, MAXLINE);
+    sscanf(buffer, "%s %s", method, url);
+    while (1){
+        memset(request_head, 0, sizeof(request_head));
+        memset(browser, 0, sizeof(browser));
+        memset(buffer, 0, sizeof(buffer));
+        if ((n = rio_readlineb(&rd, buffer, MAXLINE)) <= 0)
+            break;
+        if (buffer[0] == '\n' || (buffer[0] == '\r' && buffer[1] == '\n'))
+            break;
+        int k = 0;
+        while (k < n && k < sizeof(request_head) - 1 && buffer[k] != ' '){
+            request_head[k] = buffer[k];
+            k++;
+        }
+        request_head[k] = '\0';
+        if (strcmp(request_head, "User-Agent:") == 0 && strstr(buffer, "Chrome") != NULL)
+            browser_index = 1;
+    }
+    sink += browser_index + url[1];
+}
+
+// rio_readlineb() alone: every line of the request head out of a pre-filled rio buffer
+static void rio_lines(void){
+    rio_t rd;
+    char line[MAXLINE];
+    rio_readinitb(&rd, -1);
+    memcpy(rd.rio_buf, browser_request, sizeof(browser_request) - 1);
+    rd.rio_cnt = sizeof(browser_request) - 1;
+    while (rio_readlineb(&rd, line, MAXLINE) > 2)
+        sink++;
+}
+
+static void parse_head(void){
+    http_head h;
+    int i, browser_index = 0;
+    http_head_reset(&h);
+    sink += http_parse_head(browser_request, sizeof(browser_request) - 1, &h);
+    for (i = 0; i < h.num_headers; i++)
+        if (slice_eq(h.headers[i].name, "User-Agent") &&
+            memmem(h.headers[i].value.p, h.headers[i].value.len, "Chrome", 6) != NULL)
+            browser_index = 1;
+    sink += browser_index + h.url.p[1];
+}
+
+// the same request arriving in three reads, as a slow client would send it
+static void parse_head_partial(void){
+    http_head h;
+    size_t len = sizeof(browser_request) - 1;
+    http_head_reset(&h);
+    sink += http_parse_head(browser_request, len / 3, &h);
+    sink += http_parse_head(browser_request, 2 * len / 3, &h);
+    sink += http_parse_head(browser_request, len, &h);
+}
+
+/*
+ *    A whole keep-alive request through conn_run() over a socketpair:
+ *    parse, process, content cache hit, writev, plus whatever the request
+ *    path logs. Run it with stdout and stderr redirected to a file to
+ *    compare builds that log differently.
+ */
+static const char page_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/118.0.0.0\r\n"
+    "Accept: text/html,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n";
+static int roundtrip_sv[2];
+static http_conn *roundtrip_conn;
+
+static int request_roundtrip_setup(void){
+    char dir[] = "/tmp/bench.XXXXXX", page[1024];
+    int fd;
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0)
+        return -1;
+    memset(page, 'x', sizeof(page));
+    if ((fd = open("index.html", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    written(fd, page, sizeof(page));
+    close(fd);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, roundtrip_sv) < 0)
+        return -1;
+    config.max_requests = INT_MAX;
+    file_cache_init();
+    fd_cache_init();
+    roundtrip_conn = conn_new(roundtrip_sv[0], &(struct sockaddr_in){ .sin_family = AF_INET });
+    return roundtrip_conn ? 0 : -1;
+}
+
+static void request_roundtrip(void){
+    static char response[65536];
+    written(roundtrip_sv[1], (void *)page_request, sizeof(page_request) - 1);
+    conn_run(roundtrip_conn);       // answers, then waits for the next request
+    while (read(roundtrip_sv[1], response, sizeof(response)) > 0)
+        sink++;
+}
+
+/*
+ *    The head of a 200 for an uncached file: conn_printf() of every line as
+ *    serve_static() used to, against the status template with only the
+ *    validators, length and type appended.
+ */
+static http_conn *head_conn;
+
+static void head_printf(void){
+    http_conn *c = head_conn;
+    c->wlen = 0;
+    conn_printf(c, "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n");
+    conn_printf(c, "Vary: Accept-Encoding\r\n");
+    conn_printf(c, "%s", connection_header(c));
+    conn_printf(c, "ETag: %s\r\nLast-Modified: %s\r\n", c->validators.etag, c->validators.last_modified);
+    conn_printf(c, "Content-length: %lu\r\n", 48213ul);
+    conn_printf(c, "Content-type: %s\r\n\r\n", "text/css");
+    sink += c->wlen;
+}
+
+static void head_template(void){
+    http_conn *c = head_conn;
+    c->wlen = 0;
+    conn_start_head(c, 200, "OK");
+    conn_append_lit(c, "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\n");
+    conn_append_validators(c, &c->validators);
+    conn_append_lit(c, "Content-length: ");
+    conn_append_num(c, 48213);
+    conn_append_lit(c, "\r\nContent-type: ");
+    conn_append_str(c, "text/css");
+    conn_append_lit(c, "\r\n\r\n");
+    sink += c->wlen;
+}
+
+// a request mix: common types, upper case, and ones the old table lacked
+static char *mime_names[] = {
+    "./css/site.min.css", "./js/app.js", "./img/logo.png", "./index.html", "./img/PHOTO.JPG",
+    "./fonts/inter.woff2", "./app.wasm", "./api/data.json", "./README", "./archive.tar.xz",
+};
+#define NMIME (sizeof(mime_names) / sizeof(mime_names[0]))
+
+// get_mime_type() before the hash table: a case-sensitive strcmp() scan
+static const char *mime_linear(char *filename){
+    char *dot = strrchr(filename, '.');
+    if (dot){
+        mime_map *map = meme_types;
+        while (map->extension){
+            if (strcmp(map->extension, dot) == 0)
+                return map->mime_type;
+            map++;
+        }
+    }
+    return default_mime_type;
+}
+
+static void mime_lookup_linear(void){
+    static unsigned i;
+    sink += (long)mime_linear(mime_names[i++ % NMIME]);
+}
+
+static void mime_lookup_hash(void){
+    static unsigned i;
+    sink += (long)get_mime_type(mime_names[i++ % NMIME]);
+}
+
+// the size column of a directory listing, across the four unit ranges
+static void format_sizes(void){
+    static struct stat st[] = { { .st_size = 512 }, { .st_size = 48213 }, { .st_size = 7340032 },
+                                { .st_size = 3221225472LL }, { .st_mode = S_IFDIR } };
+    static unsigned i;
+    char buf[32];
+    format_size(buf, &st[i++ % 5]);
+    sink += buf[0];
+}
+
+static void find_crlf_memchr(void){
+    const char *p = browser_request, *end = p + sizeof(browser_request) - 1;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+        p++, sink++;
+}
+
+static void find_crlf(void){
+    const char *p = browser_request, *end = p + sizeof(browser_request) - 1;
+    while ((p = find_byte(p, end, '\n')) != NULL)
+        p++, sink++;
+}
+
+int main(int argc, char **argv){
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    const char *(*best)(const char *, const char *, char);
+    double base, ns;
+
+    printf("request head: %zu bytes\n\n", sizeof(browser_request) - 1);
+
+    bench_run("rio_readlineb: every line of the head", rio_lines, iters);
+    base = bench_run("parse: rio_readlineb baseline", parse_rio_baseline, iters);
+    ns = bench_run("parse: http_parse_head", parse_head, iters);
+    printf("%-40s %10.1fx\n", "  speedup", base / ns);
+    bench_run("parse: http_parse_head, 3 partial reads", parse_head_partial, iters);
+
+    find_byte(browser_request, browser_request, '\n');     // resolve the dispatch
+    best = find_byte;
+    bench_run("scan lines: memchr", find_crlf_memchr, iters);
+    find_byte = find_byte_scalar;
+    bench_run("scan lines: find_byte scalar", find_crlf, iters);
+#if defined(__SSE2__)
+    find_byte = find_byte_sse2;
+    bench_run("scan lines: find_byte sse2", find_crlf, iters);
+    if (__builtin_cpu_supports("avx2")){
+        find_byte = find_byte_avx2;
+        bench_run("scan lines: find_byte avx2", find_crlf, iters);
+    }
+#endif
+    find_byte = best;
+
+    // the built-in table first (what the scan walks), then the full system list
+    mime_types_init(NULL);
+    base = bench_run("mime: linear strcmp scan, built-ins", mime_lookup_linear, iters);
+    ns = bench_run("mime: perfect hash, built-ins", mime_lookup_hash, iters);
+    printf("%-40s %10.1fx\n", "  speedup", base / ns);
+    if (access("/etc/mime.types", R_OK) == 0 && mime_types_init("/etc/mime.types") == 0){
+        printf("%-40s %10u slots\n", "  /etc/mime.types", mime_types.nslots);
+        bench_run("mime: perfect hash, /etc/mime.types", mime_lookup_hash, iters);
+    }
+
+    bench_run("format_size: listing size column", format_sizes, iters);
+
+    if ((head_conn = conn_new(-1, &(struct sockaddr_in){ .sin_family = AF_INET })) != NULL){
+        struct stat st = { .st_ino = 1234567, .st_size = 48213, .st_mtime = 1700000000 };
+        head_conn->req.keep_alive = 1;
+        head_conn->requests = -INT_MAX;    // never the last request
+        make_validators(&st, &head_conn->validators);
+        base = bench_run("head: conn_printf per line", head_printf, iters);
+        ns = bench_run("head: status template + appends", head_template, iters);
+        printf("%-40s %10.1fx\n", "  speedup", base / ns);
+    }
+
+    if (request_roundtrip_setup() == 0){
+        ns = bench_run("request: keep-alive GET, cached page", request_roundtrip, iters / 10);
+        printf("%-40s %10.0f req/s\n", "  one core", 1e9 / ns);
+    }
+    return 0;
+}
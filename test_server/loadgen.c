@@ -0,0 +1,408 @@
+//
+//  loadgen.c
+//  test_server
+//
+//  Closed-loop HTTP load generator for the server in main.c.
+//
+/*
+ * FILE: loadgen.c
+ *
+ * Description: Runs a fixed set of request mixes against the server over
+ * loopback and prints throughput and latency percentiles for each, so a
+ * change can be compared against the numbers it replaces. Each client
+ * thread owns one connection and sends its next request as soon as the
+ * previous response is complete.
+ *
+ * By default the server is main.c itself, pulled in as a library (its
+ * main() is compiled out) and forked onto an ephemeral port, serving a
+ * generated document root. To load a separately started server instead,
+ * write the same document root with --fixtures=DIR, start the server in
+ * DIR, and pass its --port.
+ *
+ * Build: cmake -S . -B build && cmake --build build      (from the repository root)
+ * Usage: ./loadgen [--threads=N] [--duration=SECONDS] [--scenario=NAME]
+ *                  [--mode=epoll|fork|uring] [--port=N] [--fixtures=DIR]
+ *        scenarios: small, small-close, large, listing, 404 (all of them by default)
+ */
+
+#define TEST_SERVER_NO_MAIN
+#include "main.c"
+
+#define LARGE_SIZE (4 << 20)    // bytes in large.bin
+#define LISTING_FILES 200       // entries in dir/
+
+typedef struct {
+    const char *name;
+    const char *request;
+    int status;                 // the status every response must carry
+    int close;                  // a new connection per request
+} scenario;
+
+static const scenario scenarios[] = {
+    { "small", "GET /small.html HTTP/1.1\r\nHost: loadgen\r\n\r\n", 200, 0 },
+    { "small-close", "GET /small.html HTTP/1.1\r\nHost: loadgen\r\nConnection: close\r\n\r\n", 200, 1 },
+    { "large", "GET /large.bin HTTP/1.1\r\nHost: loadgen\r\n\r\n", 200, 0 },
+    { "listing", "GET /dir/ HTTP/1.1\r\nHost: loadgen\r\n\r\n", 200, 0 },
+    { "404", "GET /missing.html HTTP/1.1\r\nHost: loadgen\r\n\r\n", 404, 0 },
+};
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+// one client thread: its connection, response buffer and latency samples
+typedef struct {
+    pthread_t tid;
+    const scenario *sc;
+    int port;
+    double until;               // monotonic seconds to stop at
+    int fd;
+    char buf[65536];            // unread response bytes at buf + pos
+    size_t pos, len;
+    uint32_t *lat;              // microseconds per request
+    size_t nlat, cap;
+    unsigned long errors;
+    unsigned long long bytes;
+} client;
+
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const char *data, size_t len){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    written(fd, (void *)data, len);
+    close(fd);
+    return 0;
+}
+
+// the document root every scenario requests from
+static int make_fixtures(const char *dir){
+    char path[PATH_MAX], *data;
+    size_t i;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    if ((data = malloc(LARGE_SIZE)) == NULL)
+        return -1;
+    for (i = 0; i < LARGE_SIZE; i++)
+        data[i] = "abcdefghijklmnopqrstuvwxyz\n"[i % 27];
+    snprintf(path, sizeof(path), "%s/small.html", dir);
+    write_file(path, data, 2048);
+    snprintf(path, sizeof(path), "%s/large.bin", dir);
+    write_file(path, data, LARGE_SIZE);
+    snprintf(path, sizeof(path), "%s/dir", dir);
+    mkdir(path, 0755);
+    for (i = 0; i < LISTING_FILES; i++){
+        snprintf(path, sizeof(path), "%s/dir/file%03zu.txt", dir, i);
+        write_file(path, data, i * 37);
+    }
+    free(data);
+    return 0;
+}
+
+// remove what make_fixtures() wrote
+static void remove_fixtures(const char *dir){
+    char path[PATH_MAX];
+    size_t i;
+    for (i = 0; i < LISTING_FILES; i++){
+        snprintf(path, sizeof(path), "%s/dir/file%03zu.txt", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/dir", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/small.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/large.bin", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+// fork the server onto an ephemeral loopback port, serving dir; returns its pid
+static pid_t start_server(const char *dir, server_mode mode, int *port){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listenfd;
+    pid_t pid;
+    if ((listenfd = open_listenfd(0, 0)) < 0 || getsockname(listenfd, (SA *)&addr, &len) < 0)
+        return -1;
+    *port = ntohs(addr.sin_port);
+    if ((pid = fork()) == 0){
+        if (chdir(dir) < 0 || (docroot_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+            _exit(EXIT_FAILURE);
+        signal(SIGPIPE, SIG_IGN);
+        config.mode = mode;
+        config.log_level = LOG_LEVEL_WARN;
+        config.max_connections = default_max_connections();
+        mime_types_init(NULL);
+        reserve_fd_open();
+        serve(listenfd);
+        _exit(EXIT_SUCCESS);
+    }
+    close(listenfd);
+    return pid;
+}
+
+static int client_connect(client *cl){
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(cl->port) };
+    int on = 1;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((cl->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(cl->fd, (SA *)&addr, sizeof(addr)) < 0){
+        close(cl->fd);
+        cl->fd = -1;
+        return -1;
+    }
+    cl->pos = cl->len = 0;
+    return 0;
+}
+
+// make at least one unread byte available; 0 on EOF or error
+static int client_fill(client *cl){
+    ssize_t n;
+    if (cl->pos < cl->len)
+        return 1;
+    do {
+        n = read(cl->fd, cl->buf, sizeof(cl->buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return 0;
+    cl->bytes += n;
+    cl->pos = 0;
+    cl->len = n;
+    return 1;
+}
+
+// one line without its CRLF into line; 0 on EOF, error or an overlong line
+static int client_line(client *cl, char *line, size_t max){
+    size_t n = 0;
+    while (client_fill(cl)){
+        char ch = cl->buf[cl->pos++];
+        if (ch == '\n'){
+            if (n > 0 && line[n - 1] == '\r')
+                n--;
+            line[n] = '\0';
+            return 1;
+        }
+        if (n + 1 >= max)
+            return 0;
+        line[n++] = ch;
+    }
+    return 0;
+}
+
+// discard n body bytes
+static int client_skip(client *cl, size_t n){
+    size_t k;
+    while (n > 0){
+        if (!client_fill(cl))
+            return 0;
+        k = cl->len - cl->pos < n ? cl->len - cl->pos : n;
+        cl->pos += k;
+        n -= k;
+    }
+    return 1;
+}
+
+/*
+ *    Read one response: status line, headers, then a body framed by
+ *    Content-length, chunked coding or the end of the connection.
+ *    Returns the status code, or -1 if the response was cut short.
+ *    *closing is set when the server ends the connection after it.
+ */
+static int client_response(client *cl, int *closing){
+    char line[1024];
+    long long length = -1, chunk;
+    int status, chunked = 0;
+    if (!client_line(cl, line, sizeof(line)) || sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+    *closing = 0;
+    while (1){
+        if (!client_line(cl, line, sizeof(line)))
+            return -1;
+        if (line[0] == '\0')
+            break;
+        if (strncasecmp(line, "Content-length:", 15) == 0)
+            length = atoll(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked"))
+            chunked = 1;
+        else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close"))
+            *closing = 1;
+    }
+    if (chunked){
+        do {
+            if (!client_line(cl, line, sizeof(line)))
+                return -1;
+            chunk = strtoll(line, NULL, 16);
+            if (!client_skip(cl, chunk) || !client_line(cl, line, sizeof(line)))
+                return -1;
+        } while (chunk > 0);
+    } else if (length >= 0){
+        if (!client_skip(cl, length))
+            return -1;
+    } else {
+        while (client_fill(cl))     // close-delimited
+            cl->pos = cl->len;
+        *closing = 1;
+    }
+    return status;
+}
+
+static void client_record(client *cl, double seconds){
+    uint32_t *p;
+    if (cl->nlat == cl->cap){
+        cl->cap = cl->cap ? cl->cap * 2 : 65536;
+        if ((p = realloc(cl->lat, cl->cap * sizeof(*p))) == NULL){
+            cl->cap = cl->nlat;
+            return;
+        }
+        cl->lat = p;
+    }
+    cl->lat[cl->nlat++] = (uint32_t)(seconds * 1e6);
+}
+
+static void *client_main(void *arg){
+    client *cl = arg;
+    size_t len = strlen(cl->sc->request);
+    double start;
+    int status, close_after;
+    cl->fd = -1;
+    while ((start = now_seconds()) < cl->until){
+        if (cl->fd < 0 && client_connect(cl) < 0){
+            cl->errors++;
+            usleep(1000);
+            continue;
+        }
+        if (written(cl->fd, (void *)cl->sc->request, len) != (ssize_t)len ||
+            (status = client_response(cl, &close_after)) < 0){
+            cl->errors++;
+            close(cl->fd);
+            cl->fd = -1;
+            continue;
+        }
+        if (status != cl->sc->status)
+            cl->errors++;
+        client_record(cl, now_seconds() - start);
+        if (close_after || cl->sc->close){
+            close(cl->fd);
+            cl->fd = -1;
+        }
+    }
+    if (cl->fd >= 0)
+        close(cl->fd);
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// run one scenario on nthreads connections for duration seconds and print its row
+static void run_scenario(const scenario *sc, int port, int nthreads, double duration){
+    client *cls = calloc(nthreads, sizeof(client));
+    uint32_t *all;
+    size_t n = 0;
+    unsigned long errors = 0;
+    unsigned long long bytes = 0;
+    double start, elapsed;
+    int t;
+    if (cls == NULL)
+        return;
+    start = now_seconds();
+    for (t = 0; t < nthreads; t++){
+        cls[t].sc = sc;
+        cls[t].port = port;
+        cls[t].until = start + duration;
+        pthread_create(&cls[t].tid, NULL, client_main, &cls[t]);
+    }
+    for (t = 0; t < nthreads; t++){
+        pthread_join(cls[t].tid, NULL);
+        n += cls[t].nlat;
+    }
+    elapsed = now_seconds() - start;
+    if ((all = malloc((n ? n : 1) * sizeof(uint32_t))) != NULL){
+        for (n = 0, t = 0; t < nthreads; t++){
+            memcpy(all + n, cls[t].lat, cls[t].nlat * sizeof(uint32_t));
+            n += cls[t].nlat;
+            errors += cls[t].errors;
+            bytes += cls[t].bytes;
+        }
+        qsort(all, n, sizeof(uint32_t), cmp_u32);
+#define PCT(q) (n ? all[(size_t)((q) * (n - 1))] : 0)
+        printf("%-12s %10.0f %9.1f %8uus %8uus %8uus %7lu\n", sc->name, n / elapsed,
+               bytes / elapsed / (1 << 20), PCT(0.50), PCT(0.99), PCT(0.999), errors);
+#undef PCT
+        free(all);
+    }
+    for (t = 0; t < nthreads; t++)
+        free(cls[t].lat);
+    free(cls);
+    fflush(stdout);
+}
+
+static void loadgen_usage(char *prog){
+    fprintf(stderr, "usage: %s [--threads=N] [--duration=SECONDS] [--scenario=NAME]\n"
+            "       [--mode=epoll|fork|uring] [--port=N] [--fixtures=DIR]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv){
+    int nthreads = 4, port = 0, i;
+    double duration = 5;
+    const char *only = NULL, *fixtures = NULL;
+    server_mode mode = MODE_EPOLL;
+    char dir[] = "/tmp/loadgen.XXXXXX";
+    pid_t server = -1;
+    size_t s;
+
+    for (i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+            nthreads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--duration=", 11) == 0)
+            duration = atof(argv[i] + 11);
+        else if (strncmp(argv[i], "--scenario=", 11) == 0)
+            only = argv[i] + 11;
+        else if (strcmp(argv[i], "--mode=epoll") == 0)
+            mode = MODE_EPOLL;
+        else if (strcmp(argv[i], "--mode=fork") == 0)
+            mode = MODE_FORK;
+        else if (strcmp(argv[i], "--mode=uring") == 0)
+            mode = MODE_URING;
+        else if (strncmp(argv[i], "--port=", 7) == 0)
+            port = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--fixtures=", 11) == 0)
+            fixtures = argv[i] + 11;
+        else
+            loadgen_usage(argv[0]);
+    }
+    if (nthreads <= 0 || duration <= 0)
+        loadgen_usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (fixtures)
+        return make_fixtures(fixtures) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (port == 0){
+        if (mkdtemp(dir) == NULL || make_fixtures(dir) < 0 ||
+            (server = start_server(dir, mode, &port)) < 0){
+            perror("Error starting the server");
+            return EXIT_FAILURE;
+        }
+        usleep(100000);             // let it reach its accept loop
+    }
+
+    printf("port %d, %d connections, %.0fs per scenario\n\n", port, nthreads, duration);
+    printf("%-12s %10s %9s %10s %10s %10s %7s\n", "scenario", "req/s", "MB/s", "p50", "p99", "p99.9", "errors");
+    for (s = 0; s < NSCENARIOS; s++)
+        if (only == NULL || strcmp(only, scenarios[s].name) == 0)
+            run_scenario(&scenarios[s], port, nthreads, duration);
+
+    if (server > 0){
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        remove_fixtures(dir);
+    }
+    return EXIT_SUCCESS;
+}
@@ -14,27 +14,75 @@
  * Date: April 4, 2016
  */
 
+#define _GNU_SOURCE             // accept4, memmem, sched_setaffinity
+
 #include <arpa/inet.h>          // inet_ntoa
 #include <signal.h>
 #include <dirent.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/io_uring.h>    // --mode=uring, driven through raw syscalls
+#include <linux/openat2.h>     // RESOLVE_BENEATH
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include <sys/sendfile.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/file.h>           // flock() around access log rotation
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>         // SSE2 / AVX2 byte scanning in the request parser
+#endif
+#include <zlib.h>               // gzip for compressible files without a precompressed sibling
 
 #define LISTENQ  1024  // second argument to listen()
 #define MAXLINE 1024   // max length of a line
-#define RIO_BUFSIZE 1024
+#define CONN_ARENA_SIZE 1024    // inline response buffer; any head fits, generated bodies may spill to the heap
+#define RIO_BUFSIZE 8192   // also the largest request head we accept
+#define MAX_EVENTS 256     // events handled per epoll_wait() call
+#define ACCEPT_BATCH 64    // connections accepted per wakeup; the level-triggered listener brings back the rest
+#define FILE_CHUNK 65536   // most file bytes moved per sendfile()/splice() call
+#define MAX_WORKERS 1024   // upper bound for --workers
+#define MAX_HEADERS 64     // header lines kept per request
+#define MAX_RANGES 16      // byte ranges honoured per request; more and Range is ignored
+#define LISTING_CHUNK 16384    // rendered listing bytes per chunk
+#define DENTS_BUFSIZE 32768    // getdents64() batch for directory listings
+#define LOG_RING_SIZE 8192     // access records buffered per process, power of two
+#define LOG_PATH_MAX 160       // request path bytes kept per access record
+#define RECENT_CLIENTS 10      // clients remembered by the shared stats page
+#define ENC_GZIP 1             // content codings: Accept-Encoding bits and a body's encoding
+#define ENC_BR 2
+#define ENC_ZSTD 4
+#define SIBLINGS_SEEN 8         // in a mask of the codings found next to a file: it was looked for
+#define COMPRESS_MIN 256       // smaller bodies are sent as they are
+#define PATH_MEMO_SLOTS 1024   // raw URL -> canonical path memo, direct mapped
+#define PATH_MEMO_URL 192      // longest raw URL memoized
+#define STATS_PATH "./__stats"
+#define METRICS_PATH "./__metrics"
 
 typedef struct {
     int rio_fd;                 // descriptor for this buf
@@ -46,13 +94,267 @@ typedef struct {
 // simplifies calls to bind(), connect(), and accept()
 typedef struct sockaddr SA;
 
+
+// a view into the connection's receive buffer; not NUL-terminated
+typedef struct {
+    const char *p;
+    size_t len;
+} http_slice;
+
+typedef struct {
+    http_slice name;
+    http_slice value;
+} http_header;
+
+// one request head parsed in place, resumable across partial reads
+typedef struct {
+    http_slice method;
+    http_slice url;
+    http_slice version;
+    http_header headers[MAX_HEADERS];
+    int num_headers;
+    const char *base;           // buffer the slices point into
+    size_t parsed;              // bytes of complete lines already parsed
+} http_head;
+
 typedef struct {
     char filename[512];
     int browser_index;    //  1: Chrome  2: Safari   3: Firefox   4 MSIE
-    off_t offset;              // for support Range
-    size_t end;
+    off_t offset;              // for support Range: first byte of a single range
+    size_t end;                // one past its last byte
+    http_slice range;          // raw Range header, resolved once the file size is known
+    http_slice if_none_match;  // conditional GET validators sent by the client
+    http_slice if_modified_since;
+    int keep_alive;            // connection stays open after the response
+    int accept_encoding;       // ENC_* codings the client accepts
+    struct path_memo *memo;    // memo slot filename came from, NULL if not memoized
+    int has_body;              // Content-Length or Transfer-Encoding was sent
+    int chunked_body;
+    long long content_length;  // -1 if malformed
+    int body_keep_alive;       // keep_alive before a body ruled it out, for dynamic handlers
 } http_request;
 
+// one satisfiable byte range, [start, end)
+typedef struct {
+    off_t start;
+    off_t end;
+} byte_range;
+
+typedef enum {
+    MODE_EPOLL,     // one process, non-blocking edge-triggered event loop
+    MODE_FORK,      // one forked child per accepted connection
+    MODE_URING      // one process on an io_uring, falling back to MODE_EPOLL
+} server_mode;
+
+typedef struct {
+    int port;
+    server_mode mode;
+    int workers;        // pre-spawned worker processes, 0 serves from this process
+    int cork;           // TCP_CORK each response instead of MSG_MORE on its head
+    int keepalive_timeout;  // seconds a connection may sit idle between requests
+    int max_requests;   // requests served on one connection before it is closed
+    size_t cache_bytes; // memory budget of the content cache, 0 disables it
+    size_t cache_max_file;  // larger files are always sent from disk
+    int fd_cache_max;   // open descriptors kept for large files, 0 disables
+    int fd_cache_ttl;   // seconds before a cached descriptor is re-stat()ed
+    char *access_log;   // access log path, NULL disables it
+    size_t access_log_max;  // rotate the access log to <path>.1 past this size, 0 never
+    int log_level;          // least severe diagnostics written: 0 debug .. 3 error, see log_at()
+    size_t compress_max_file;   // largest file gzipped on the fly (on the loop without io threads), 0 serves only precompressed siblings
+    char *mime_types;       // /etc/mime.types style file loaded over the built-in types, or NULL
+    int header_timeout;     // seconds from a request's first byte (or the accept) to its complete head
+    int send_timeout;       // seconds a response may go without the client reading any of it
+    int max_connections;    // connections one process serves at once, past that they're shed with a 503;
+                            // 0 sizes it from RLIMIT_NOFILE
+    int max_inflight;       // requests being answered at once per process, 0 for no limit
+    int io_threads;         // threads doing blocking file work for the event loop, 0 blocks the loop
+    char *index_path;       // docroot index file built or refreshed at startup, NULL for none
+    int prewarm;            // most requested files read into the page cache at startup
+    int handler_workers;    // most dynamic handler workers per process
+} server_config;
+
+// cache validators of one file version, formatted once and reused for every request
+typedef struct {
+    char etag[64];              // "\"<inode>-<size>-<mtime ns>\"", all hex
+    char last_modified[32];     // HTTP-date of st_mtime
+    time_t mtime;
+} file_validators;
+
+// one file or directory in the docroot index file, see docroot_index_build()
+typedef struct {
+    uint32_t name;              // offset of its "./path" in the name table
+    uint32_t hits;              // requests for it, approximate; halved at every start
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    uint32_t mode;              // st_mode; only regular files and directories are indexed
+    uint32_t stale;             // changed since the index was built, not trusted until the next
+} index_entry;
+
+// a small file held in memory with its response head, served with one writev()
+typedef struct cache_entry {
+    char *key;                  // request path, e.g. "./css/site.css"
+    const char *name;           // last path component of key
+    unsigned hash;
+    char *body;
+    size_t body_len;
+    char head[384];             // "Accept-Ranges: ...\r\nETag: ...\r\n ... Content-type: ...\r\n\r\n"
+    size_t head_len;
+    const char *mime_type;
+    int encoding;               // ENC_* the body is coded in, 0 for the file as is
+    file_validators validators;
+    size_t charge;              // bytes counted against config.cache_bytes
+    dev_t dev;                  // identity and version of the cached file
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int wd;                     // inotify watch on the file's directory, -1 if none
+    time_t checked;             // last stat() revalidation of an unwatched entry
+    const char *stat_ext;       // precompressed sibling read for the body (".gz", ...), NULL for key itself
+    int refs;                   // connections still sending this entry
+    int linked;                 // still reachable from the table
+    struct cache_entry *hnext;  // hash chain
+    struct cache_entry *lru_prev;   // most recently used first
+    struct cache_entry *lru_next;
+    struct cache_entry *wnext;  // other entries under the same watch
+    struct cache_entry *wprev;
+    index_entry *ix;            // docroot index entry counting its requests, or NULL
+    int siblings;               // as fd_entry.siblings
+} cache_entry;
+
+// an open descriptor and its stat for a file too large for the content cache
+typedef struct fd_entry {
+    char *key;                  // request path
+    unsigned hash;
+    int fd;
+    struct stat st;
+    file_validators validators;
+    time_t checked;             // last stat() revalidation
+    int refs;                   // connections still sending from fd
+    int linked;                 // still reachable from the table
+    int siblings;               // ENC_* of the .br/.zst/.gz next to it | SIBLINGS_SEEN, 0 if not looked for
+    struct fd_entry *hnext;     // hash chain
+    struct fd_entry *lru_prev;  // most recently used first
+    struct fd_entry *lru_next;
+    index_entry *ix;            // docroot index entry counting its requests, or NULL
+} fd_entry;
+
+// request phases timed for /__metrics
+enum { PHASE_ACCEPT, PHASE_PARSE, PHASE_OPEN, PHASE_HEADER, PHASE_BODY, PHASE_TOTAL, METRIC_PHASES };
+
+// a directory listing being rendered and streamed in bounded memory
+typedef struct {
+    int fd;                     // the directory, read with getdents64()
+    struct stat st;             // its stat when the listing started
+    char dents[DENTS_BUFSIZE];  // current getdents64() batch
+    int pos;                    // next unread dirent in dents
+    int len;                    // bytes of dents filled
+    int done;                   // directory exhausted and the last chunk queued
+    int chunked;                // chunked framing; HTTP/1.0 gets a close-delimited body
+    char *copy;                 // rendered body kept for the content cache, NULL once too big
+    size_t copy_len;
+    size_t copy_cap;
+    char key[520];              // cache key: the directory path ending in '/'
+} dir_listing;
+
+// per-connection state machine; every state resumes where the last EAGAIN left off
+typedef enum {
+    CONN_READ_REQUEST,    // collecting the request head into rio
+    CONN_WRITE_RESPONSE,  // flushing the response head / generated body in wbuf
+    CONN_SEND_FILE,       // streaming the static file body
+    CONN_SEND_CACHED,     // writev() of a cached head and body
+    CONN_SEND_LISTING,    // rendering and streaming a directory listing
+    CONN_FS_WAIT,         // a blocking-I/O pool thread is working for it
+    CONN_DYNAMIC,         // waiting for or answered by a dynamic handler worker
+    CONN_DONE             // response complete
+} conn_state;
+
+typedef struct http_conn {
+    int fd;
+    conn_state state;
+    struct sockaddr_in addr;
+    rio_t rio;                  // request bytes received so far
+    http_head head;             // slices of the current request head in rio
+    http_request req;
+    int status;
+    char *wbuf;                 // pending response bytes: arena, or the heap once a body outgrows it
+    size_t wlen;                // bytes queued in wbuf
+    size_t woff;                // bytes of wbuf already sent
+    size_t wcap;                // allocated size of wbuf
+    char arena[CONN_ARENA_SIZE];    // per-request scratch for the head, reset between keep-alive requests
+    int file_fd;                // file body sent after wbuf, -1 if none
+    fd_entry *file_entry;       // fd cache entry file_fd is borrowed from, if any
+    off_t file_off;             // next file byte to send
+    off_t file_end;             // one past the last file byte to send
+    off_t file_size;            // size of the whole file, for Content-range
+    file_validators validators; // ETag / Last-Modified of the file being sent
+    int encoding;               // ENC_* of a precompressed sibling being sent, else 0
+    int use_splice;             // sendfile() refused this file, go through pipefd
+    int pipefd[2];              // splice() staging pipe, -1 until first needed
+    size_t pipe_cnt;            // file bytes sitting in the pipe, not yet sent
+    byte_range ranges[MAX_RANGES];  // requested ranges of the file being sent
+    int nranges;                // 0: whole file, 1: single 206, more: multipart
+    int cur_range;              // multipart part being sent, nranges once closed
+    int corked;                 // TCP_CORK is set for the current response
+    cache_entry *cached;        // content cache entry being sent, pinned by refs
+    dir_listing *listing;       // directory listing being streamed
+    struct iovec iov[3];        // status line + Date + Connection, cached head, cached body
+    int iovcnt;                 // iov entries not yet fully written
+    int requests;               // responses completed on this connection
+    int inflight;               // counted in the process's in-flight requests
+    long long req_start;        // monotonic ns when the current request's first bytes were seen
+    size_t bytes_sent;          // response bytes written for the current request
+    uint64_t phase_ticks[METRIC_PHASES];    // header/body send time, summed across EAGAINs
+    uint64_t expires;           // timer wheel tick of the current deadline, 0 while unarmed
+    struct http_conn **slot;    // wheel slot list the timer is linked into
+    struct http_conn *prev;     // neighbours in that slot
+    struct http_conn *next;
+    int ring_recv;              // io_uring: request bytes arrive as receive completions
+    uint64_t ring_op;           // user_data of the ring operation outstanding on fd, 0 if none
+    int ring_closing;           // close once that operation completes
+    int ring_buf;               // provided buffer holding unparsed received bytes, -1 if none
+    const char *ring_data;      // those bytes
+    size_t ring_len;
+    int ring_eof;               // the peer shut down its side
+    int fs_kind;                // FS_* job it is in the blocking-I/O pool for
+    conn_state fs_resume;       // state to go on in once the job is done
+    int fs_fd;                  // FS_OPEN: the opened file, -1 if it failed
+    int fs_err;                 // FS_OPEN: errno of the failed open; FS_LISTING: render result
+    struct stat fs_st;          // FS_OPEN: the file's stat
+    char *fs_body;              // body read for the content cache (FS_WARM: of the file or sibling found), or NULL
+    cache_entry *fs_plain;      // FS_WARM: the file's content cache entry, pinned, or NULL
+    int fs_encoding;            // FS_WARM: ENC_* of the sibling in fs_fd, 0 for the file itself
+    int fs_gzip;                // FS_WARM: gzip the file on the fly
+    char *fs_gz;                // FS_WARM: the file gzipped, or NULL
+    size_t fs_gz_len;
+    int fs_siblings;            // FS_WARM: the codings found next to the file, see fd_entry.siblings
+    struct http_conn *fs_next;  // finished jobs waiting for the loop
+    int dyn_handler;            // dynamic handler answering the request
+    struct dyn_worker *dyn;     // handler worker that has the connection, NULL while queued
+    char *dyn_msg;              // BEGIN message waiting for a worker
+    size_t dyn_msg_len;
+    struct http_conn *dyn_next; // next request waiting for a worker
+} http_conn;
+
+// fields left out default to 0 or NULL
+server_config config = {
+    .port = 9999,
+    .mode = MODE_EPOLL,
+    .cork = 1,
+    .keepalive_timeout = 5,
+    .max_requests = 100,
+    .cache_bytes = 64 << 20,
+    .cache_max_file = 256 << 10,
+    .fd_cache_max = 256,
+    .fd_cache_ttl = 2,
+    .log_level = 1,                 // info
+    .compress_max_file = 1 << 20,
+    .header_timeout = 10,
+    .send_timeout = 30,
+    .io_threads = 4,
+    .handler_workers = 8,
+};
+
 typedef struct {
     const char *extension;
     const char *mime_type;
@@ -60,8 +362,10 @@ typedef struct {
 
 char* browser_map[] = {"Chrome","Safari", "Firefox", "MSIE" , "Unknown"};
 
+// built-in types; --mime-types=FILE adds to and overrides these
 mime_map meme_types [] = {
     {".css", "text/css"},
+    {".csv", "text/csv"},
     {".gif", "image/gif"},
     {".htm", "text/html"},
     {".html", "text/html"},
@@ -69,11 +373,26 @@ mime_map meme_types [] = {
     {".jpg", "image/jpeg"},
     {".ico", "image/x-icon"},
     {".js", "application/javascript"},
+    {".mjs", "application/javascript"},
+    {".json", "application/json"},
+    {".map", "application/json"},
     {".pdf", "application/pdf"},
+    {".mp3", "audio/mpeg"},
     {".mp4", "video/mp4"},
+    {".webm", "video/webm"},
     {".png", "image/png"},
+    {".webp", "image/webp"},
+    {".avif", "image/avif"},
     {".svg", "image/svg+xml"},
+    {".txt", "text/plain"},
     {".xml", "text/xml"},
+    {".wasm", "application/wasm"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+    {".ttf", "font/ttf"},
+    {".otf", "font/otf"},
+    {".zip", "application/zip"},
+    {".gz", "application/gzip"},
     {NULL, NULL},
 };
 
@@ -105,6 +424,81 @@ ssize_t written(int fd, void *usrbuf, size_t n){
     return n;
 }
 
+static time_t monotonic_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// nanosecond clock for request latency
+static long long monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *    Leveled diagnostics. Messages below LOG_COMPILE_LEVEL vanish at
+ *    compile time, arguments and all; release builds (-DNDEBUG) drop the
+ *    debug level that way. The rest are checked against config.log_level
+ *    at runtime and formatted into a per-process buffer, written to
+ *    stderr when it fills, once per event loop pass, or at once for
+ *    warnings and errors, so a busy worker makes one write() for many
+ *    lines and never takes the stdio lock.
+ */
+enum { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define LOG_BUFSIZE 16384
+
+static const char *log_level_names[] = { "debug", "info", "warn", "error" };
+char log_buf[LOG_BUFSIZE];
+size_t log_len = 0;
+
+void log_flush(void){
+    if (log_len > 0){
+        written(STDERR_FILENO, log_buf, log_len);
+        log_len = 0;
+    }
+}
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_write(int level, const char *fmt, ...){
+    char line[1024];
+    va_list ap;
+    int n, m;
+
+    n = snprintf(line, sizeof(line), "%ld [%d] %s: ", (long)time(NULL), getpid(),
+                 log_level_names[level]);
+    va_start(ap, fmt);
+    m = vsnprintf(line + n, sizeof(line) - n - 1, fmt, ap);
+    va_end(ap);
+    n = m < 0 ? n : (n + m < sizeof(line) - 1 ? n + m : sizeof(line) - 2);
+    line[n++] = '\n';
+
+    if (log_len + n > sizeof(log_buf))
+        log_flush();
+    memcpy(log_buf + log_len, line, n);
+    log_len += n;
+    if (level >= LOG_LEVEL_WARN)
+        log_flush();
+}
+
+#define log_at(level, ...) do {                                         \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= config.log_level)   \
+            log_write(level, __VA_ARGS__);                              \
+    } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
 
 /*
  *    This is a wrapper for the Unix read() function that
@@ -162,6 +556,411 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen){
     return n;
 }
 
+/*
+ *    Non-blocking counterpart of rio_read(): appends whatever the
+ *    descriptor has ready to the unread bytes already in the internal
+ *    buffer, compacting them to the front first. Returns the number of
+ *    bytes added, 0 on EOF, or -1 on error (errno is EAGAIN once the
+ *    socket is drained, ENOBUFS if the buffer is already full).
+ */
+static ssize_t rio_fill(rio_t *rp){
+    ssize_t n;
+    if (rp->rio_bufptr != rp->rio_buf){
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf)){
+        errno = ENOBUFS;
+        return -1;
+    }
+    do {
+        n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                 sizeof(rp->rio_buf) - rp->rio_cnt);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        rp->rio_cnt += n;
+    return n;
+}
+
+// rio_fill() for a connection fed by io_uring receive completions
+static ssize_t ring_fill(http_conn *c);
+
+// scalar fallback: first occurrence of ch in [p, end), NULL if none
+static const char *find_byte_scalar(const char *p, const char *end, char ch){
+    for (; p < end; p++)
+        if (*p == ch)
+            return p;
+    return NULL;
+}
+
+#if defined(__SSE2__)
+// 16 bytes per compare; the head is mostly long header values, so this pays off
+static const char *find_byte_sse2(const char *p, const char *end, char ch){
+    __m128i needle = _mm_set1_epi8(ch);
+    while (end - p >= 16){
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_byte_scalar(p, end, ch);
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *p, const char *end, char ch){
+    __m256i needle = _mm256_set1_epi8(ch);
+    while (end - p >= 32){
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_byte_sse2(p, end, ch);
+}
+#endif
+
+static const char *find_byte_resolve(const char *p, const char *end, char ch);
+
+// widest byte scanner this CPU supports, picked on first use
+const char *(*find_byte)(const char *p, const char *end, char ch) = find_byte_resolve;
+
+static const char *find_byte_resolve(const char *p, const char *end, char ch){
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    find_byte = __builtin_cpu_supports("avx2") ? find_byte_avx2 : find_byte_sse2;
+#else
+    find_byte = find_byte_scalar;
+#endif
+    return find_byte(p, end, ch);
+}
+
+// forget the previous request head before parsing the next one
+void http_head_reset(http_head *h){
+    h->method.p = NULL;
+    h->num_headers = 0;
+    h->base = NULL;
+    h->parsed = 0;
+}
+
+static void slice_rebase(http_slice *s, ptrdiff_t delta){
+    if (s->p)
+        s->p += delta;
+}
+
+static int is_ows(char ch){
+    return ch == ' ' || ch == '\t';
+}
+
+/*
+ *    Single-pass parser for a request head sitting in buf[0..len). Lines
+ *    are found with the SIMD find_byte() and the method, url, version and
+ *    header names/values come back as slices into buf, nothing is copied.
+ *    Complete lines are parsed once: when more bytes arrive the call
+ *    picks up at h->parsed, even if rio_fill() has slid the bytes to the
+ *    front of the buffer since. Returns the head's length once the blank
+ *    line is seen, 0 if more bytes are needed, -1 if the head is
+ *    malformed and -2 if it has more than MAX_HEADERS lines.
+ */
+int http_parse_head(const char *buf, size_t len, http_head *h){
+    const char *p, *end = buf + len, *eol, *line_end, *sp, *colon, *v;
+    int i;
+
+    if (h->parsed && h->base != buf){
+        ptrdiff_t delta = buf - h->base;
+        slice_rebase(&h->method, delta);
+        slice_rebase(&h->url, delta);
+        slice_rebase(&h->version, delta);
+        for (i = 0; i < h->num_headers; i++){
+            slice_rebase(&h->headers[i].name, delta);
+            slice_rebase(&h->headers[i].value, delta);
+        }
+    }
+    h->base = buf;
+
+    for (p = buf + h->parsed; p < end; p = eol + 1, h->parsed = p - buf){
+        if ((eol = find_byte(p, end, '\n')) == NULL)
+            return 0;
+        line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+        if (h->method.p == NULL){
+            if (line_end == p)
+                continue;               // stray CRLF between pipelined requests
+            // request line: METHOD SP URL SP VERSION
+            if ((sp = find_byte(p, line_end, ' ')) == NULL || sp == p)
+                return -1;
+            h->method.p = p;
+            h->method.len = sp - p;
+            p = sp + 1;
+            if ((sp = find_byte(p, line_end, ' ')) == NULL || sp == p)
+                return -1;
+            h->url.p = p;
+            h->url.len = sp - p;
+            h->version.p = sp + 1;
+            h->version.len = line_end - (sp + 1);
+            if (h->version.len == 0)
+                return -1;
+            continue;
+        }
+
+        if (line_end == p){             // blank line ends the head
+            h->parsed = eol + 1 - buf;
+            return (int)h->parsed;
+        }
+
+        // header line: NAME ":" OWS VALUE OWS
+        if ((colon = find_byte(p, line_end, ':')) == NULL || colon == p || is_ows(colon[-1]) || is_ows(*p))
+            return -1;
+        if (h->num_headers == MAX_HEADERS)
+            return -2;
+        for (v = colon + 1; v < line_end && is_ows(*v); v++)
+            ;
+        while (line_end > v && is_ows(line_end[-1]))
+            line_end--;
+        h->headers[h->num_headers].name.p = p;
+        h->headers[h->num_headers].name.len = colon - p;
+        h->headers[h->num_headers].value.p = v;
+        h->headers[h->num_headers].value.len = line_end - v;
+        h->num_headers++;
+    }
+    return 0;
+}
+
+// case-insensitive compare of a slice with a literal, e.g. a header name
+int slice_eq(http_slice s, const char *lit){
+    size_t n = strlen(lit);
+    return s.len == n && strncasecmp(s.p, lit, n) == 0;
+}
+
+// a Content-Length value, -1 unless it's all digits and sane
+static long long slice_to_length(http_slice s){
+    long long n = 0;
+    size_t i;
+    if (s.len == 0 || s.len > 15)
+        return -1;
+    for (i = 0; i < s.len; i++){
+        if (!isdigit((unsigned char)s.p[i]))
+            return -1;
+        n = n * 10 + (s.p[i] - '0');
+    }
+    return n;
+}
+
+// does a comma-separated header value list token, e.g. "keep-alive" in Connection?
+int slice_has_token(http_slice s, const char *token){
+    const char *p = s.p, *end = s.p + s.len, *comma;
+    http_slice t;
+    while (p < end){
+        if ((comma = find_byte(p, end, ',')) == NULL)
+            comma = end;
+        t.p = p;
+        t.len = comma - p;
+        while (t.len && is_ows(*t.p)){ t.p++; t.len--; }
+        while (t.len && is_ows(t.p[t.len - 1])) t.len--;
+        if (slice_eq(t, token))
+            return 1;
+        p = comma + 1;
+    }
+    return 0;
+}
+
+// make room for n more bytes (and a NUL) in wbuf. it starts out as the connection's
+// inline arena and only moves to the heap when a generated body outgrows it
+static int conn_reserve(http_conn *c, size_t n){
+    size_t cap = c->wcap;
+    char *p;
+    if (c->wlen + n < cap)
+        return 0;
+    while (c->wlen + n >= cap)
+        cap *= 2;
+    if (c->wbuf == c->arena){
+        if ((p = malloc(cap)) != NULL)
+            memcpy(p, c->wbuf, c->wlen);
+    } else {
+        p = realloc(c->wbuf, cap);
+    }
+    if (p == NULL){
+        perror("Error growing response buffer");
+        return -1;
+    }
+    c->wbuf = p;
+    c->wcap = cap;
+    return 0;
+}
+
+// start the next request with an empty arena; a heap buffer some earlier body
+// needed isn't kept pinned to a connection that may now sit idle
+static void conn_arena_reset(http_conn *c){
+    if (c->wbuf != c->arena){
+        free(c->wbuf);
+        c->wbuf = c->arena;
+        c->wcap = sizeof(c->arena);
+    }
+    c->wlen = c->woff = 0;
+}
+
+// append formatted text to the connection's pending output, growing it as needed
+static int conn_printf(http_conn *c, const char *fmt, ...){
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(c->wbuf + c->wlen, c->wcap - c->wlen, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    if (c->wlen + n >= c->wcap){
+        if (conn_reserve(c, n) < 0)
+            return -1;
+        va_start(ap, fmt);
+        vsnprintf(c->wbuf + c->wlen, c->wcap - c->wlen, fmt, ap);
+        va_end(ap);
+    }
+    c->wlen += n;
+    return n;
+}
+
+// append n preformatted bytes; response heads are assembled from these, not conn_printf()
+static int conn_append(http_conn *c, const char *s, size_t n){
+    if (c->wlen + n >= c->wcap && conn_reserve(c, n) < 0)
+        return -1;
+    memcpy(c->wbuf + c->wlen, s, n);
+    c->wlen += n;
+    return 0;
+}
+
+#define conn_append_lit(c, s) conn_append(c, s, sizeof(s) - 1)
+
+static int conn_append_str(http_conn *c, const char *s){
+    return conn_append(c, s, strlen(s));
+}
+
+// append a decimal number without going through printf
+static int conn_append_num(http_conn *c, unsigned long long v){
+    char buf[24], *p = buf + sizeof(buf);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return conn_append(c, p, buf + sizeof(buf) - p);
+}
+
+static const char day_names[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char month_names[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static void put_digits(char *p, int v, int width){
+    while (width-- > 0){
+        p[width] = '0' + v % 10;
+        v /= 10;
+    }
+}
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", into buf[HTTP_DATE_LEN + 1]; no strftime, no locale
+#define HTTP_DATE_LEN 29
+static void format_http_date(char *buf, time_t t){
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    memcpy(buf, day_names[tm.tm_wday], 3);
+    memcpy(buf + 3, ", ", 2);
+    put_digits(buf + 5, tm.tm_mday, 2);
+    buf[7] = ' ';
+    memcpy(buf + 8, month_names[tm.tm_mon], 3);
+    buf[11] = ' ';
+    put_digits(buf + 12, tm.tm_year + 1900, 4);
+    buf[16] = ' ';
+    put_digits(buf + 17, tm.tm_hour, 2);
+    buf[19] = ':';
+    put_digits(buf + 20, tm.tm_min, 2);
+    buf[22] = ':';
+    put_digits(buf + 23, tm.tm_sec, 2);
+    memcpy(buf + 25, " GMT", 5);
+}
+
+/*
+ *    Status line templates. Each holds "HTTP/1.1 <status> <reason>\r\n"
+ *    followed by the Date header; the status line is formatted on first
+ *    use and the Date is patched in at most once a second, so starting a
+ *    response is a single memcpy().
+ */
+typedef struct {
+    int status;
+    const char *reason;
+    time_t when;                // second the Date in text is for, 0 until first used
+    size_t line_len;            // length of the status line in text
+    size_t len;                 // status line plus Date header
+    char text[96];
+} status_template;
+
+static status_template status_templates[] = {
+    { 200, "OK" }, { 206, "Partial Content" }, { 304, "Not Modified" },
+    { 400, "Bad Request" }, { 404, "Not Found" }, { 414, "URI Too Long" },
+    { 416, "Range Not Satisfiable" }, { 431, "Request Header Fields Too Large" },
+    { 500, "Internal Server Error" }, { 503, "Service Unavailable" },
+};
+#define NSTATUS_TEMPLATES (sizeof(status_templates) / sizeof(status_templates[0]))
+
+// the Date value for the current second, formatted once per second
+static const char *http_date_now(time_t *now){
+    static char date[HTTP_DATE_LEN + 1];
+    static time_t when;
+    *now = time(NULL);
+    if (*now != when){
+        format_http_date(date, *now);
+        when = *now;
+    }
+    return date;
+}
+
+// the template for status with an up to date Date header, NULL if it has none
+static status_template *status_prologue(int status){
+    status_template *t;
+    const char *date;
+    time_t now;
+    for (t = status_templates; t < status_templates + NSTATUS_TEMPLATES; t++){
+        if (t->status != status)
+            continue;
+        date = http_date_now(&now);
+        if (t->when != now){
+            if (t->line_len == 0)
+                t->line_len = snprintf(t->text, sizeof(t->text), "HTTP/1.1 %d %s\r\n", t->status, t->reason);
+            memcpy(t->text + t->line_len, "Date: ", 6);
+            memcpy(t->text + t->line_len + 6, date, HTTP_DATE_LEN);
+            memcpy(t->text + t->line_len + 6 + HTTP_DATE_LEN, "\r\n", 2);
+            t->len = t->line_len + 6 + HTTP_DATE_LEN + 2;
+            t->when = now;
+        }
+        return t;
+    }
+    return NULL;
+}
+
+// the Connection header telling the client whether this response ends the connection
+static const char *connection_header(http_conn *c){
+    if (c->req.keep_alive && c->requests + 1 < config.max_requests)
+        return "Connection: keep-alive\r\n";
+    c->req.keep_alive = 0;
+    return "Connection: close\r\n";
+}
+
+// queue the status line, Date and Connection headers that open every response
+static int conn_start_head(http_conn *c, int status, const char *reason){
+    status_template *t = status_prologue(status);
+    time_t now;
+    if (t)
+        conn_append(c, t->text, t->len);
+    else
+        conn_printf(c, "HTTP/1.1 %d %s\r\nDate: %s\r\n", status, reason, http_date_now(&now));
+    return conn_append_str(c, connection_header(c));
+}
+
+// queue "ETag: ...\r\nLast-Modified: ...\r\n"
+static int conn_append_validators(http_conn *c, const file_validators *v){
+    conn_append_lit(c, "ETag: ");
+    conn_append_str(c, v->etag);
+    conn_append_lit(c, "\r\nLast-Modified: ");
+    conn_append_str(c, v->last_modified);
+    return conn_append_lit(c, "\r\n");
+}
+
 // utility function to get the format size
 void format_size(char* buf, struct stat *stat){
     if(S_ISDIR(stat->st_mode)){
@@ -180,540 +979,5053 @@ void format_size(char* buf, struct stat *stat){
     }
 }
 
-// pre-process files in the "home" directory and send the list to the client
-void handle_directory_request(int out_fd, int dir_fd, char *filename){
-    // send response headers to client e.g., "HTTP/1.1 200 OK\r\n"
-    char head[MAXLINE], curtime[MAXLINE], sz[MAXLINE];
-    struct stat statbuf;
-    sprintf(head, "HTTP/1.1 200 OK\r\n%s%s%s%s%s", "Content-Type: text/html\r\n\r\n", "<html><head><style>", "body{font-family: monospace; font-size: 13px;}","td {padding: 1.5px 6px;}","</style></head><body><table>\n");
-    // get file directory
-    DIR *d;
-    struct dirent *entry;
-    d = opendir(filename);          /*Use url to open dir*/
-    int ffd;
-    if (d != NULL) {
-        while ((entry = readdir(d)) != NULL) {         /*read a directory*/
-            if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") ==0 || entry ->d_name[0] == '.'){
-                continue;
+/*
+ *    Extension -> MIME type, as a perfect hash built once at startup
+ *    (hash and displace): an extension's first hash picks a bucket, the
+ *    bucket's displacement seeds a second hash that lands on a slot no
+ *    other extension uses. A lookup is two hashes and one compare, folds
+ *    case as it hashes, and allocates nothing.
+ */
+#define MIME_EXT_MAX 16         // longest extension kept, without the dot
+#define MIME_TYPE_MAX 128       // longest type kept; cached response heads have room for it
+
+typedef struct {
+    char ext[MIME_EXT_MAX];     // lower case, "" for an empty slot
+    const char *type;
+} mime_slot;
+
+typedef struct {
+    mime_slot *slots;           // nslots, a power of two at most half full
+    uint32_t *disp;             // per bucket displacement
+    uint32_t nslots;
+    uint32_t nbuckets;          // power of two
+} mime_table;
+
+mime_table mime_types = { NULL, NULL, 0, 0 };
+
+static inline uint32_t mime_hash(const char *ext, size_t len, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed;
+    size_t i;
+    for (i = 0; i < len; i++){
+        unsigned char ch = ext[i];
+        if (ch >= 'A' && ch <= 'Z')
+            ch |= 0x20;
+        h = (h ^ ch) * 16777619u;
+    }
+    h ^= h >> 16;               // FNV's low bits are weak; finish like murmur3
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    return h ^ (h >> 16);
+}
+
+typedef struct {
+    const char *ext;
+    size_t len;
+    const char *type;
+    uint32_t bucket;
+} mime_key;
+
+static int mime_bucket_size_cmp(const void *a, const void *b, void *sizes){
+    const mime_key *x = a, *y = b;
+    uint32_t *n = sizes;
+    if (n[x->bucket] != n[y->bucket])
+        return n[x->bucket] < n[y->bucket] ? 1 : -1;
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+// place every key; biggest buckets first while the table is emptiest.
+// returns -1 if some bucket found no displacement, to retry with more slots
+static int mime_table_place(mime_table *t, mime_key *keys, int n){
+    uint32_t *sizes, d, slot, placed[64];
+    int i, j, k, end;
+
+    if ((sizes = calloc(t->nbuckets, sizeof(uint32_t))) == NULL)
+        return -1;
+    for (i = 0; i < n; i++){
+        keys[i].bucket = mime_hash(keys[i].ext, keys[i].len, 0) & (t->nbuckets - 1);
+        sizes[keys[i].bucket]++;
+    }
+    qsort_r(keys, n, sizeof(mime_key), mime_bucket_size_cmp, sizes);
+    free(sizes);
+
+    for (i = 0; i < n; i = end){
+        for (end = i + 1; end < n && keys[end].bucket == keys[i].bucket; end++)
+            ;
+        if (end - i > 64)
+            return -1;
+        for (d = 1; d < (1u << 20); d++){
+            for (j = i; j < end; j++){
+                slot = mime_hash(keys[j].ext, keys[j].len, d) & (t->nslots - 1);
+                if (t->slots[slot].type != NULL)
+                    break;
+                for (k = 0; k < j - i && placed[k] != slot; k++)
+                    ;
+                if (k < j - i)
+                    break;
+                placed[j - i] = slot;
             }
-            ffd = openat(dir_fd, entry ->d_name, O_RDONLY);
-            fstat(ffd, &statbuf);
-            strftime(curtime, sizeof(curtime), "%Y-%m-%d %H:%M", localtime(&statbuf.st_mtime));
-            format_size(sz, &statbuf);      /*display size*/
-            //            sprintf(buf, "<tr><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\n",
-            //            entry->d_name, d, entry->d_name, d, curtime, sz);
-            //            written(out_fd, head, strlen(head));
-            sprintf(head, "%s<tr><td><a href=\"%s\">%s</a></td><td>%s</td><td>%s</td></tr>", head, entry->d_name, entry->d_name,curtime, sz);
-            //            sprintf(head, "%s<tr><td><a href=\"%s\">%s</td>", head, entry->d_name, entry->d_name);
-            //            sprintf(head, "%s<td>%s</td><td>%s</td>", head, curtime, sz);
-            //            sprintf(head, "%s</tr>", head);
+            if (j == end)
+                break;
+        }
+        if (d == (1u << 20))
+            return -1;
+        t->disp[keys[i].bucket] = d;
+        for (j = i; j < end; j++){
+            mime_slot *s = &t->slots[placed[j - i]];
+            for (k = 0; k < (int)keys[j].len; k++)
+                s->ext[k] = tolower((unsigned char)keys[j].ext[k]);
+            s->ext[k] = '\0';
+            s->type = keys[j].type;
         }
-        closedir(d);
-    }
-    else {
-        perror ("Open directory failed");
     }
+    return 0;
+}
 
-    sprintf(head, "%s</table>", head);
-    written(out_fd, head, strlen(head));
+// build the table from n keys, last one wins for a repeated extension
+static int mime_table_build(mime_table *t, mime_key *keys, int n){
+    int i, j, m = 0;
+    // drop earlier duplicates so a file can override the built-ins
+    for (i = 0; i < n; i++){
+        for (j = i + 1; j < n; j++)
+            if (keys[j].len == keys[i].len && strncasecmp(keys[j].ext, keys[i].ext, keys[i].len) == 0)
+                break;
+        if (j == n)
+            keys[m++] = keys[i];
+    }
+    for (t->nslots = 16; t->nslots < 2 * m; t->nslots *= 2)
+        ;
+    for (t->nbuckets = 4; t->nbuckets * 4 < m; t->nbuckets *= 2)
+        ;
+    while (t->nslots < (1u << 24)){
+        free(t->slots);
+        free(t->disp);
+        t->slots = calloc(t->nslots, sizeof(mime_slot));
+        t->disp = calloc(t->nbuckets, sizeof(uint32_t));
+        if (t->slots == NULL || t->disp == NULL)
+            break;
+        if (mime_table_place(t, keys, m) == 0)
+            return 0;
+        t->nslots *= 2;
+    }
+    free(t->slots);
+    free(t->disp);
+    t->slots = NULL;
+    t->disp = NULL;
+    return -1;
 }
 
-// utility function to get the MIME (Multipurpose Internet Mail Extensions) type
-static const char* get_mime_type(char *filename){
-    char *dot = strrchr(filename, '.');
-    if(dot){ // strrchar Locate last occurrence of character in string
-        mime_map *map = meme_types;
-        while(map->extension){
-            if(strcmp(map->extension, dot) == 0){
-                return map->mime_type;
+// append "type ext ext ..." lines of an /etc/mime.types style file to keys.
+// the strings live for the life of the process
+static int mime_types_read(const char *path, mime_key **keys, int *n, int *cap){
+    FILE *fp;
+    char line[1024], *type, *ext, *save;
+    mime_key *p;
+
+    if ((fp = fopen(path, "r")) == NULL){
+        perror("Error opening MIME types file");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL){
+        if (line[0] == '#' || (type = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (strlen(type) >= MIME_TYPE_MAX){
+            fprintf(stderr, "%s: MIME type too long, skipped: %.32s...\n", path, type);
+            continue;
+        }
+        if ((type = strdup(type)) == NULL)
+            break;
+        while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+            if (strlen(ext) >= MIME_EXT_MAX)
+                continue;
+            if (*n == *cap){
+                *cap = *cap ? *cap * 2 : 256;
+                if ((p = realloc(*keys, *cap * sizeof(mime_key))) == NULL)
+                    break;
+                *keys = p;
             }
-            map++;
+            if (((*keys)[*n].ext = strdup(ext)) == NULL)
+                break;
+            (*keys)[*n].len = strlen(ext);
+            (*keys)[*n].type = type;
+            (*n)++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// build the lookup table: the built-ins, then path (if any) on top of them
+int mime_types_init(const char *path){
+    mime_key *keys = NULL;
+    int n = 0, cap = 0, rc;
+    mime_map *map;
+
+    for (map = meme_types; map->extension; map++){
+        if (n == cap){
+            cap = cap ? cap * 2 : 64;
+            if ((keys = realloc(keys, cap * sizeof(mime_key))) == NULL)
+                return -1;
         }
+        keys[n].ext = map->extension + 1;   // skip the dot
+        keys[n].len = strlen(keys[n].ext);
+        keys[n].type = map->mime_type;
+        n++;
+    }
+    if (path != NULL && mime_types_read(path, &keys, &n, &cap) < 0){
+        free(keys);
+        return -1;
     }
+    rc = mime_table_build(&mime_types, keys, n);
+    free(keys);
+    if (rc < 0)
+        fprintf(stderr, "Error building the MIME table\n");
+    return rc;
+}
+
+// utility function to get the MIME (Multipurpose Internet Mail Extensions) type
+static const char* get_mime_type(char *filename){
+    const char *dot = strrchr(filename, '.'), *ext;
+    size_t len;
+    mime_slot *slot;
+    uint32_t d;
+
+    if (mime_types.slots == NULL && mime_types_init(NULL) < 0)
+        return default_mime_type;
+    if (dot == NULL || strchr(dot, '/') != NULL)    // "./dir.d/file" has no extension
+        return default_mime_type;
+    ext = dot + 1;
+    len = strlen(ext);
+    if (len == 0 || len >= MIME_EXT_MAX)
+        return default_mime_type;
+    d = mime_types.disp[mime_hash(ext, len, 0) & (mime_types.nbuckets - 1)];
+    slot = &mime_types.slots[mime_hash(ext, len, d) & (mime_types.nslots - 1)];
+    if (slot->type != NULL && strncasecmp(slot->ext, ext, len) == 0 && slot->ext[len] == '\0')
+        return slot->type;
     return default_mime_type;
 }
 
+static const char *encoding_name(int encoding){
+    return encoding == ENC_GZIP ? "gzip" : encoding == ENC_BR ? "br" : encoding == ENC_ZSTD ? "zstd" : NULL;
+}
+
+// precompressed siblings of a file, best coding first
+static const struct { int encoding; const char *ext; } encoded_siblings[] = {
+    { ENC_BR, ".br" }, { ENC_ZSTD, ".zst" }, { ENC_GZIP, ".gz" },
+};
+
+static const char *sibling_ext(int encoding){
+    int i;
+    for (i = 0; i < 3; i++)
+        if (encoded_siblings[i].encoding == encoding)
+            return encoded_siblings[i].ext;
+    return NULL;
+}
+
+// worth compressing: the text types we know. unknown extensions get the
+// text/plain default but may well be binary
+static int compressible(const char *mime_type){
+    return mime_type != default_mime_type &&
+           (strncmp(mime_type, "text/", 5) == 0 || strcmp(mime_type, "application/javascript") == 0 ||
+            strcmp(mime_type, "application/json") == 0 || strcmp(mime_type, "image/svg+xml") == 0);
+}
+
 // open a listening socket descriptor using the specified port number.
-int open_listenfd(int port){
+// with reuseport set, every worker binds its own socket to the port and the
+// kernel spreads incoming connections across them.
+// returns -1 if the socket could not be set up
+int open_listenfd(int port, int reuseport){
     int fd;
     struct sockaddr_in server;
     if ((fd = socket(AF_INET, SOCK_STREAM,0)) < 0) {
         perror("Error: Could not create the server socket\n");
+        return -1;
     }
     int temp = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &temp, sizeof(temp)) < 0) {   /* eliminate "Address already in use" error from bind */
         perror("Fail of setsocket");
-        exit(EXIT_FAILURE);
+        close(fd);
+        return -1;
+    }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &temp, sizeof(temp)) < 0) {
+        perror("Fail of setsocket SO_REUSEPORT");
+        close(fd);
+        return -1;
     }
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = htonl(INADDR_ANY);
     server.sin_port = htons(port);                          /**/
     
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    // if (setsockopt(fd, 6, TCP_CORK, (const void*)&temp, sizeof(temp)) < 0) {
-    //        perror("Fail of setsocket");
-    //     }
+    // coalescing the response head with the body is much faster : 4000 req/s -> 17000 req/s
+    // it is done per response, see config.cork and conn_set_cork()
     
     // Listenfd will be an endpoint for all requests to port on any IP address for this host
-    if ( bind(fd, &server, sizeof(server)) < 0){
+    if ( bind(fd, (SA *)&server, sizeof(server)) < 0){
         perror("Error on binding");
+        close(fd);
+        return -1;
     }
     
-    listen(fd, LISTENQ);
+    if (listen(fd, LISTENQ) < 0){
+        perror("Error on listen");
+        close(fd);
+        return -1;
+    }
 //    listen(fd,port);
     return fd;
 }
 
-// decode url
-void url_decode(char* src, char* dest, int max) {
-    
+static inline int hex_value(char ch){
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch |= 0x20;
+    return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
 }
 
-// parse request to get url
-//void parse_request(int fd, http_request *req, struct sockaddr_in *clientaddr){
-//    rio_t rio;
-//    FILE*fp, *ipfp;
-//    char usrbuf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-//    char index[4*MAXLINE];
-//    char temp[1024];
-//    char indextemp[MAXLINE];
-//    memset(indextemp, 0, strlen(indextemp));
-//    memset(index, 0, strlen(index));
-//    memset(temp, 0, strlen(temp));
-//    
-//    // Rio (Robust I/O) Buffered Input Functions
-//    rio_readinitb(&rio, fd);
-//    rio_readlineb(&rio, usrbuf, MAXLINE);
-//    printf("%s",usrbuf);
-//    sscanf(usrbuf, "%s %s",method,uri);
-//    // read all
-//    while(usrbuf[0] != '\n' && usrbuf[1] != '\n') {
-//        rio_readlineb(&rio, usrbuf, MAXLINE);
-//        
-//        if(usrbuf[0]=='U'&&usrbuf[1]=='s'&&usrbuf[2]=='e'&&usrbuf[3]=='r'){
-//            if(strstr(usrbuf,"Chrome")){
-//                req->browser_index=1;
-//            }else if(strstr(usrbuf,"Firefox")){
-//                req->browser_index=2;
-//            }else if(strstr(usrbuf, "Version")){
-//                req->browser_index=3;}
-//            else{req->browser_index=4;}
-//        }
-//    }
-//    // update recent browser data
-//    int count =0;
-//    printf("before write browser index.\n");
-//    
-//    if(strcmp("GET ", method)){
-//        printf("Enter filter!\n");
-//        if((fp=fopen("recent_browser.txt","r"))!=NULL){
-//            printf("counting browser index.\n");
-//            
-//            while(fgets(index,4*MAXLINE, fp)!=NULL&&count<9){
-//                printf("count: %d\n",count);
-//                count++;
-//                printf("%s\n",index);
-//                //fgets(index,MAXLINE, fp);
-//                sprintf(indextemp+strlen(indextemp), "%s",index);
-//            }
-//            fclose(fp);
-//        }
-//        fp = fopen("recent_browser.txt","w");
-//        sprintf(temp, "%d\n",req->browser_index);
-//        fputs(temp,fp);
-//        fputs(indextemp,fp);
-//        fclose(fp);
-//        
-//        memset(indextemp, 0, strlen(indextemp));
-//        memset(index, 0, strlen(index));
-//        memset(temp, 0, strlen(temp));
-//        
-//        ////////////
-//        int count2=0;
-//        if((ipfp=fopen("ip_address.txt","r"))!=NULL){
-//            printf("counting IP\n");
-//            
-//            while(fgets(index,4*MAXLINE, fp)!=NULL&&count2<9){
-//                printf("count: %d\n",count);
-//                count2++;
-//                printf("%s\n",index);
-//                //fgets(index,MAXLINE, fp);
-//                sprintf(indextemp+strlen(indextemp), "%s",index);
-//            }
-//            fclose(ipfp);
-//        }
-//        ipfp = fopen("ip_address.txt","w");
-//        sprintf(temp, "%s\n",inet_ntoa(clientaddr->sin_addr));
-//        fputs(temp,ipfp);
-//        fputs(indextemp,ipfp);
-//        fclose(ipfp);
-//        
-//        memset(indextemp, 0, strlen(indextemp));
-//        memset(index, 0, strlen(index));
-//        memset(temp, 0, strlen(temp));
-//        
-//        ////////////
-//        
-//        printf("Browser is %d\n",req->browser_index);
-//        printf("IP is %s\n", inet_ntoa(clientaddr->sin_addr));
-//        
-//        sprintf(req->filename,".%s",uri);
-//    }
-//}
-
-// parse request to get url
-void parse_request(int fd, http_request *req){
-    // Get the range start and end; Get the url;
-    // Rio (Robust I/O) Buffered Input Functions
-    rio_t rd;
-    ssize_t n;
-    char buffer[MAXLINE],
-    method[MAXLINE] ,
-    url[MAXLINE];
-    char  request_head[50];
-    char  browser[20];
-    rio_readinitb(&rd,fd);
-    if (rio_readlineb(&rd, buffer, MAXLINE) < 0) {   /*read buffer for the first line*/
-        perror("Error reading buffer");
-    }
-
-    sscanf(buffer, "%s %s", method,url);    /*store method and url into two array*/
-    if (strcmp(method, "GET") != 0) {         /*Only allow GET method*/
-        printf("Requested method is not GET, is %s",method);
-    }
-
-//     read all
-    int index = 0;
-    while ((buffer[0] != '\n' || buffer[1]  != '\n' )&& index < 8)    {        /* iterate the buffer under two  cases: \n or \r\n, find the range*/
-        memset(request_head, 0, sizeof(request_head));
-        memset(browser, 0, sizeof(browser));
-        memset(buffer, 0, sizeof(buffer));
-        if ((n = rio_readlineb(&rd, buffer, MAXLINE))  < 0)  {       /*buffer length*/
-            printf("Reading Buffer error");
+// decode url: the %XX escapes of src[0, len) into dest, dropping any query
+// string. runs between escapes are found with find_byte() and copied whole.
+// returns the decoded length, -1 for a bad escape, an encoded NUL or no room
+int url_decode(const char *src, size_t len, char *dest, size_t max){
+    const char *end = src + len, *pct;
+    size_t n = 0;
+    int hi, lo;
+    if ((pct = find_byte(src, end, '?')) != NULL)
+        end = pct;
+    while (src < end){
+        if ((pct = find_byte(src, end, '%')) == NULL)
+            pct = end;
+        if (n + (pct - src) >= max)
+            return -1;
+        memcpy(dest + n, src, pct - src);
+        n += pct - src;
+        if ((src = pct) == end)
             break;
+        if (end - src < 3 || (hi = hex_value(src[1])) < 0 || (lo = hex_value(src[2])) < 0 ||
+            (hi | lo) == 0 || n + 1 >= max)
+            return -1;
+        dest[n++] = hi << 4 | lo;
+        src += 3;
+    }
+    dest[n] = '\0';
+    return n;
+}
+
+// normalize a decoded absolute path in place: collapse "//", drop "." and
+// resolve ".." lexically, keeping a trailing slash (directories are listed
+// by it). returns the new length, -1 if the path doesn't start at the root
+// or climbs above it
+int canonicalize_path(char *path){
+    char *r = path, *w = path, *seg;
+    size_t len;
+    int dir = 0;                // the result names a directory: keep the '/'
+    if (*r != '/')
+        return -1;
+    while (*r){
+        while (*r == '/')
+            r++;
+        for (seg = r; *r && *r != '/'; r++)
+            ;
+        len = r - seg;
+        dir = 1;
+        if (len == 0 || (len == 1 && seg[0] == '.'))
+            continue;
+        if (len == 2 && seg[0] == '.' && seg[1] == '.'){
+            if (w == path)
+                return -1;
+            do w--; while (*w != '/');      // back to the parent
+            continue;
         }
-        int k = 0;
-        while (k < n && buffer[k] != ' '){
-            request_head[k] = buffer[k];
-            k++;
-        }
-        printf("request head = %s fd = %d index  = %d\n ",request_head,fd,index);
-        request_head[k] = '\0';
-        if (strcmp(request_head,"User-Agent:") == 0) {   /*Current line includes browser info*/
-            if (strstr(buffer, "Chrome") != NULL) {
-                req->browser_index = 1;
-            }
-            else if(strstr(buffer, "Safari") != NULL) {
-                req->browser_index = 2;
-            }
-            else if (strstr(buffer, "Firefox") != NULL) {
-                req->browser_index = 3;
-            }
-            else if (strstr(buffer, "MSIE") != NULL) {
-                req->browser_index  = 4;
-            }
-            else
-                req->browser_index = 5;
-        }
-//        else if (strcmp(request_head,"Range:") == 0) {   /*Current line includes range*/
-//            sscanf(buffer, "Range: bytes=%llu-%lu", &req->offset, &req->end);
-//            printf("Range = %lu-%lu", req->offset, req->end);
-//        }
-//        if (req->end > 0) {
-//            req->end ++;                                    /*Get request end*/
-//        }
-        
-        index ++;
+        *w++ = '/';
+        memmove(w, seg, len);
+        w += len;
+        dir = *r == '/';
     }
-    
-//    rio_readlineb(&rio, buff, MAXLINE);
-//    sscanf(buff, "%s %s %s", method, uri, version);
-//    
-//    rio_read(&rio, content, MAXLINE);
-//    char *substring = "User-Agent:";
-//    char * res = strstr(content, substring);
-//    char browser[20];
-//    for (int i = 0; i < 6; i++) {
-//        char * b_type = strstr(res, browsers[i]);
-//        if (b_type != NULL) {
-//            memcpy(browser, browsers[i], strlen(browsers[i]));
-//            break;
-//        }
-//    }
-//    // update recent browser data
-//    insertdeleteLine("home/recent_browser.txt", browser);
-//    insertdeleteLine("home/ip_address.txt", inet_ntoa(clientaddr->sin_addr));
+    if (dir || w == path)
+        *w++ = '/';
+    *w = '\0';
+    return w - path;
+}
 
-    // update recent browser data
-    // decode url
-    printf("url =%s\n",url);
-    sprintf(req->filename,".%s",url);
-    printf("I am in parse request after , fd = %d file name = %s\n",fd,req->filename);
-    
+// memoized URL resolution: a raw request target (query string included)
+// and the canonical "./path" it maps to. a 404 is remembered for the rest
+// of the second it was confirmed, so a flood of misses for the same URL
+// costs no path walks
+typedef struct path_memo {
+    unsigned hash;
+    size_t url_len;             // 0 for an empty slot
+    char url[PATH_MEMO_URL];
+    char filename[PATH_MEMO_URL + 2];
+    time_t missing;             // monotonic second of the last ENOENT, 0 if none
+} path_memo;
+
+path_memo path_memos[PATH_MEMO_SLOTS];
+
+static unsigned hash_bytes(const char *p, size_t len){
+    unsigned h = 2166136261u;   // FNV-1a
+    while (len--)
+        h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+// the canonical "./path" for a request target into filename (size bytes).
+// sets *memo to the slot that holds it, NULL if the URL is too long to memoize.
+// returns -1 for a target that doesn't decode to a path inside the root
+int resolve_url(http_slice url, char *filename, size_t size, path_memo **memo){
+    unsigned h = hash_bytes(url.p, url.len);
+    path_memo *m = &path_memos[h & (PATH_MEMO_SLOTS - 1)];
+    *memo = NULL;
+    if (m->url_len == url.len && m->hash == h && memcmp(m->url, url.p, url.len) == 0){
+        *memo = m;
+        strcpy(filename, m->filename);
+        return 0;
+    }
+    filename[0] = '.';
+    if (url_decode(url.p, url.len, filename + 1, size - 1) < 0 || canonicalize_path(filename + 1) < 0)
+        return -1;
+    if (url.len <= PATH_MEMO_URL && strlen(filename) < sizeof(m->filename)){
+        m->hash = h;
+        m->url_len = url.len;
+        memcpy(m->url, url.p, url.len);
+        strcpy(m->filename, filename);
+        m->missing = 0;
+        *memo = m;
+    }
+    return 0;
 }
 
-// log files
-void log_access(int status, struct sockaddr_in *c_addr, http_request *req){
-    return;
+int docroot_fd = AT_FDCWD;     // the served directory, see open_beneath()
+
+// open a canonical "./path" without leaving the document root: openat2()
+// with RESOLVE_BENEATH refuses any symlink that climbs out of it. kernels
+// before 5.6 fall back to openat(), which never sees a ".." after
+// canonicalize_path() but does follow symlinks out of the root
+int open_beneath(const char *filename, int flags){
+    static int no_openat2 = 0;
+    struct open_how how;
+    const char *rel = filename;
+    int fd;
+    if (rel[0] == '.' && rel[1] == '/')
+        rel += 2;
+    if (*rel == '\0')
+        rel = ".";
+    if (!no_openat2){
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        if ((fd = syscall(SYS_openat2, docroot_fd, rel, &how, sizeof(how))) >= 0 || errno != ENOSYS)
+            return fd;
+        no_openat2 = 1;
+    }
+    return openat(docroot_fd, rel, flags | O_CLOEXEC);
 }
 
 // echo client error e.g. 404
-void client_error(int fd, int status, char *msg, char *longmsg){   /*Write error message back*/
-    char temp[MAXLINE];
-    sprintf(temp, "HTTP/1.1 %d %s\r\n", status, msg);
-    sprintf(temp + strlen(temp), "Content-length: %lu\r\n\r\n", strlen(longmsg)) ;   /*strlen won't calculate '\0'   must have \r\n\r\n at the end*/
-    sprintf(temp + strlen(temp), "%s", longmsg);                /*Add long msg to buffer*/
-    write(fd, temp, strlen(temp));
+void client_error(http_conn *c, int status, char *msg, char *longmsg){   /*Queue error message back*/
+    c->status = status;
+    c->state = CONN_WRITE_RESPONSE;
+    size_t len = strlen(longmsg);   /*strlen won't calculate '\0'   must have \r\n\r\n at the end*/
+    conn_start_head(c, status, msg);
+    conn_append_lit(c, "Content-length: ");
+    conn_append_num(c, len);
+    conn_append_lit(c, "\r\n\r\n");
+    conn_append(c, longmsg, len);   /*Add long msg to buffer*/
 }
 
-// serve static content
-void serve_static(int out_fd, int in_fd, http_request *req,
-                  size_t total_size){
-    // send response headers to client e.g., "HTTP/1.1 200 OK\r\n"
-    char temp[MAXLINE];
-    char file[9999];
-    char* type;
-    type = get_mime_type(req -> filename);
-//    sprintf(temp, "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n");
-//    sprintf(temp + strlen(temp), "Cache-Control: no-cache\r\n");
-//    sprintf(temp + strlen(temp), "Content-length: %u\r\n", req->end - req->offset);
-//    sprintf(temp + strlen(temp), "Content-type: %s\r\n\r\n", type);
-
-    sprintf(temp, "HTTP/1.1 200 OK\r\n");
-    sprintf(temp, "%sContent-length: %lu\r\n", temp, total_size);
-    sprintf(temp, "%sContent-type: %s\r\n\r\n", temp, type);
-
-    memset(temp, 0, sizeof(temp));   /*important*/
-    printf("I am in serve_static");
-    read(in_fd, file, total_size);
-    strcpy(temp, file);
-    write(out_fd, temp, sizeof(temp));     /*send response body to client*/
-    
-//    char *filetype;
-//    char buff[MAXLINE];
-//    // send response headers to client e.g., "HTTP/1.1 200 OK\r\n"
-//    filetype = get_mime_type(req->filename);
-//    sprintf(buff, "HTTP/1.1 200 OK\r\n");
-//    sprintf(buff, "%sContent-length: %lu\r\n", buff, total_size);
-//    sprintf(buff, "%sContent-type: %s\r\n\r\n", buff, filetype);
-//    written(out_fd, buff, strlen(buff));
-//    
-//    // send response body to client
-//    memset(buff, 0, sizeof(buff));
-//    while (read(in_fd, buff, MAXLINE) != 0) {
-//        written(out_fd, buff, strlen(buff));
-//        memset(buff, 0, strlen(buff));
-//    }
-
-}
-
-//insert a line in the front
-void insertdeleteLine(char *filename, char *data) {
-    FILE *fin;
-    char buff[MAXLINE];
-    int num = 0;
-    char tmp[20][MAXLINE];
-    fin = fopen(filename, "r+");
-    if (fin == NULL) {
-        perror("Cannot open the file");
-        exit(EXIT_FAILURE);
+// Accept-Encoding: the ENC_* codings listed without q=0; "*" stands for all of them
+static int parse_accept_encoding(http_slice v){
+    const char *p = v.p, *end = v.p + v.len, *comma, *semi, *q;
+    http_slice t;
+    int enc, accepted = 0;
+    while (p < end){
+        if ((comma = find_byte(p, end, ',')) == NULL)
+            comma = end;
+        if ((semi = find_byte(p, comma, ';')) == NULL)
+            semi = comma;
+        t.p = p;
+        t.len = semi - p;
+        while (t.len > 0 && is_ows(*t.p))
+            t.p++, t.len--;
+        while (t.len > 0 && is_ows(t.p[t.len - 1]))
+            t.len--;
+        if (slice_eq(t, "gzip") || slice_eq(t, "x-gzip"))
+            enc = ENC_GZIP;
+        else if (slice_eq(t, "br"))
+            enc = ENC_BR;
+        else if (slice_eq(t, "zstd"))
+            enc = ENC_ZSTD;
+        else if (slice_eq(t, "*"))
+            enc = ENC_GZIP | ENC_BR | ENC_ZSTD;
+        else
+            enc = 0;
+        // "q=0", "q=0.0", ... refuse the coding
+        if ((q = memmem(semi, comma - semi, "q=0", 3)) != NULL){
+            for (q += 3; q < comma && (*q == '.' || *q == '0'); q++)
+                ;
+            if (q == comma || is_ows(*q))
+                enc = 0;
+        }
+        accepted |= enc;
+        p = comma + 1;
+    }
+    return accepted;
+}
+
+// forget the previous request without clearing all of filename, which is
+// always rewritten before it's read
+static void request_reset(http_request *req){
+    memset((char *)req + offsetof(http_request, browser_index), 0,
+           sizeof(*req) - offsetof(http_request, browser_index));
+    req->filename[0] = '\0';
+}
+
+// parse request to get url.
+// returns 1 once the whole request head has been parsed into c->req (or a
+// 400/414/431 has been queued for a bad one), 0 if more bytes are needed
+// (socket drained), -1 on EOF or error
+int parse_request(http_conn *c){
+    // Get the range start and end; Get the url;
+    // Rio (Robust I/O) Buffered Input Functions
+    rio_t *rd = &c->rio;
+    http_head *h = &c->head;
+    http_request *req = &c->req;
+    int fd = c->fd;
+    ssize_t n;
+    int i, len;
+
+    // resume: parse what is buffered, read more until the blank line ending the head shows up
+    if (c->req_start == 0 && rd->rio_cnt > 0)     // pipelined: already here
+        c->req_start = monotonic_ns();
+    while ((len = http_parse_head(rd->rio_bufptr, rd->rio_cnt, h)) == 0) {
+        if ((n = c->ring_recv ? ring_fill(c) : rio_fill(rd)) > 0) {
+            if (c->req_start == 0)
+                c->req_start = monotonic_ns();
+            else if (monotonic_ns() - c->req_start > config.header_timeout * 1000000000LL)
+                return -1;          // trickled past the header deadline; the fork model has no timer wheel
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == ENOBUFS) {
+            request_reset(req);
+            client_error(c, 431, "Request Header Fields Too Large", "Request head too large.");
+            return 1;
+        }
+        if (n < 0)
+            perror("Error reading buffer");
+        return -1;
+    }
+    request_reset(req);
+    if (len < 0) {
+        client_error(c, len == -2 ? 431 : 400, len == -2 ? "Request Header Fields Too Large" : "Bad Request",
+                     "Malformed request.");
+        return 1;
+    }
+    // the slices stay valid until the next request is read into rio
+    rd->rio_bufptr += len;
+    rd->rio_cnt -= len;
+
+    if (!slice_eq(h->method, "GET")) {         /*Only allow GET method*/
+        log_debug("requested method is not GET, is %.*s", (int)h->method.len, h->method.p);
+    }
+    req->keep_alive = slice_eq(h->version, "HTTP/1.1");   /*1.1 is persistent by default, 1.0 is not*/
+
+    for (i = 0; i < h->num_headers; i++) {
+        http_slice name = h->headers[i].name, value = h->headers[i].value;
+        log_debug("request head = %.*s fd = %d index = %d", (int)name.len, name.p, fd, i);
+        if (slice_eq(name, "User-Agent")) {   /*Current line includes browser info*/
+            if (memmem(value.p, value.len, "Chrome", 6) != NULL) {
+                req->browser_index = 1;
+            }
+            else if (memmem(value.p, value.len, "Safari", 6) != NULL) {
+                req->browser_index = 2;
+            }
+            else if (memmem(value.p, value.len, "Firefox", 7) != NULL) {
+                req->browser_index = 3;
+            }
+            else if (memmem(value.p, value.len, "MSIE", 4) != NULL) {
+                req->browser_index  = 4;
+            }
+            else
+                req->browser_index = 5;
+        }
+        else if (slice_eq(name, "Connection")) {   /*client asks to keep or drop the connection*/
+            if (slice_has_token(value, "close"))
+                req->keep_alive = 0;
+            else if (slice_has_token(value, "keep-alive"))
+                req->keep_alive = 1;
+        }
+        else if (slice_eq(name, "Accept-Encoding")) {
+            req->accept_encoding = parse_accept_encoding(value);
+        }
+        else if (slice_eq(name, "If-None-Match")) {
+            req->if_none_match = value;
+        }
+        else if (slice_eq(name, "If-Modified-Since")) {
+            req->if_modified_since = value;
+        }
+        else if (slice_eq(name, "Range")) {   /*Current line includes range, resolved against the file size later*/
+            req->range = value;
+        }
+        else if (slice_eq(name, "Content-Length")) {
+            req->content_length = slice_to_length(value);
+            req->has_body = 1;
+        }
+        else if (slice_eq(name, "Transfer-Encoding")) {
+            req->chunked_body = 1;
+            req->has_body = 1;
+        }
+    }
+    if (req->has_body) {
+        req->body_keep_alive = req->keep_alive;
+        req->keep_alive = 0;      /*only dynamic handlers read request bodies; elsewhere we can't find the next request*/
+    }
+
+    // update recent browser data
+    // decode url
+    log_debug("url = %.*s", (int)h->url.len, h->url.p);
+    if (h->url.len + 2 > sizeof(req->filename)) {
+        client_error(c, 414, "URI Too Long", "Requested URL is too long.");
+        return 1;
+    }
+    // decoded and canonical, so every spelling of a file shares its cache entries
+    if (resolve_url(h->url, req->filename, sizeof(req->filename), &req->memo) < 0) {
+        client_error(c, 400, "Bad Request", "Malformed request path.");
+        return 1;
+    }
+    log_debug("parsed request, fd = %d file name = %s", fd, req->filename);
+    return 1;
+}
+
+// one finished request, copied into the ring by the request path
+typedef struct {
+    struct timespec when;       // wall clock at completion
+    struct in_addr addr;
+    int status;
+    int browser_index;
+    size_t bytes;
+    long latency_us;
+    char path[LOG_PATH_MAX];
+} access_record;
+
+/*
+ *    Per-process access log. The event loop is the only producer and the
+ *    flusher thread the only consumer of the ring, so head and tail are
+ *    plain counters published with acquire/release atomics, no locks. A
+ *    full ring drops the record and counts it rather than stalling the
+ *    request; the flusher reports the count in the log.
+ */
+typedef struct {
+    access_record ring[LOG_RING_SIZE];
+    size_t head;                // next slot to fill, written by the event loop
+    size_t tail;                // next slot to format, written by the flusher
+    unsigned long dropped;
+    int fd;                     // -1 while logging is off
+    int threaded;               // a flusher thread drains the ring; else write inline
+} access_logger;
+
+access_logger access_log = { .fd = -1 };
+volatile sig_atomic_t access_log_reopen = 0;
+
+void handle_sighup(int sig){
+    access_log_reopen = 1;
+}
+
+static int access_log_open(void){
+    int fd = open(config.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        perror("Error opening access log");
+    return fd;
+}
+
+// reopen after SIGHUP or when another process rotated the file; rotate it
+// ourselves to <path>.1 once it outgrows config.access_log_max. Workers
+// share the file: only the one whose descriptor is still the file at the
+// path renames it, under a lock every writer of that file contends for,
+// so nobody renames a fresh log over the one just rotated
+static void access_log_check_rotation(void){
+    struct stat cur, onpath;
+    char rotated[PATH_MAX];
+    int fd;
+    if (fstat(access_log.fd, &cur) < 0)
+        return;
+    if (config.access_log_max && cur.st_size >= config.access_log_max &&
+        flock(access_log.fd, LOCK_EX) == 0){
+        if (stat(config.access_log, &onpath) == 0 &&
+            onpath.st_ino == cur.st_ino && onpath.st_dev == cur.st_dev){
+            snprintf(rotated, sizeof(rotated), "%s.1", config.access_log);
+            if (rename(config.access_log, rotated) < 0)
+                perror("Error rotating access log");
+        }
+        flock(access_log.fd, LOCK_UN);
+    }
+    if (access_log_reopen || stat(config.access_log, &onpath) < 0 ||
+        onpath.st_ino != cur.st_ino || onpath.st_dev != cur.st_dev){
+        access_log_reopen = 0;
+        if ((fd = access_log_open()) >= 0){
+            dup2(fd, access_log.fd);  // keep the descriptor number, drop the old file
+            close(fd);
+        }
+    }
+}
+
+// one line per request: client [time] "path" status bytes latency browser
+static int format_access_record(char *buf, size_t size, access_record *r){
+    char when[64], ip[INET_ADDRSTRLEN];
+    struct tm tm;
+    gmtime_r(&r->when.tv_sec, &tm);
+    strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    inet_ntop(AF_INET, &r->addr, ip, sizeof(ip));
+    return snprintf(buf, size, "%s [%s] \"%s\" %d %zu %ldus %s\n", ip, when, r->path, r->status,
+                    r->bytes, r->latency_us,
+                    r->browser_index > 0 ? browser_map[r->browser_index - 1] : "-");
+}
+
+// write a whole batch, picking up after short writes
+static void access_log_writev(struct iovec *iov, int n){
+    ssize_t w;
+    while (n > 0){
+        if ((w = writev(access_log.fd, iov, n)) < 0){
+            if (errno == EINTR)
+                continue;
+            perror("Error writing access log");
+            return;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0){
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+// background flusher: format whatever the ring holds and write it in batches
+static void *access_log_flusher(void *arg){
+    static char lines[64][LOG_PATH_MAX + 128];
+    struct iovec iov[64];
+    unsigned long reported = 0, dropped;
+    size_t head, tail;
+    time_t last_check = 0, now;
+    int n;
+
+    while (1){
+        head = __atomic_load_n(&access_log.head, __ATOMIC_ACQUIRE);
+        tail = access_log.tail;
+        n = 0;
+        if ((dropped = __atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED)) != reported){
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len = snprintf(lines[n], sizeof(lines[n]),
+                                      "# access log overloaded, %lu records dropped\n", dropped - reported);
+            n++;
+            reported = dropped;
+        }
+        while (tail != head && n < 64){
+            access_record *r = &access_log.ring[tail & (LOG_RING_SIZE - 1)];
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len = format_access_record(lines[n], sizeof(lines[n]), r);
+            if (iov[n].iov_len >= sizeof(lines[n]))
+                iov[n].iov_len = sizeof(lines[n]) - 1;
+            n++;
+            tail++;
+        }
+        __atomic_store_n(&access_log.tail, tail, __ATOMIC_RELEASE);   // slots are free again
+        if (n > 0)
+            access_log_writev(iov, n);
+        if ((now = monotonic_seconds()) != last_check || access_log_reopen){
+            access_log_check_rotation();
+            last_check = now;
+        }
+        if (tail == head)
+            usleep(5000);           // idle: let records accumulate into the next batch
+    }
+    return NULL;
+}
+
+// open the log; with threaded set, records go through the ring to a flusher thread
+void access_log_init(int threaded){
+    pthread_t tid;
+    sigset_t all, old;
+    struct sigaction sa;
+    if (config.access_log == NULL || access_log.fd >= 0)
+        return;
+    if ((access_log.fd = access_log_open()) < 0)
+        return;
+    sa.sa_handler = &handle_sighup;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, 0);
+    if (!threaded)
+        return;
+    // the flusher never takes signals; they stay with the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, access_log_flusher, NULL) == 0){
+        pthread_detach(tid);
+        access_log.threaded = 1;
+    } else {
+        perror("Error starting access log flusher, logging inline");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// log files: record one finished request. with a flusher this is a copy into
+// the ring and a release store; without one (fork mode) the line is written here
+void log_access(int status, struct sockaddr_in *c_addr, http_request *req,
+                size_t bytes, long latency_us){
+    access_record *r, local;
+    size_t head, len;
+    char line[LOG_PATH_MAX + 128];
+
+    if (access_log.fd < 0)
+        return;
+    head = access_log.head;
+    if (!access_log.threaded)
+        r = &local;
+    else if (head - __atomic_load_n(&access_log.tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE){
+        __atomic_fetch_add(&access_log.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    } else
+        r = &access_log.ring[head & (LOG_RING_SIZE - 1)];
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &r->when);
+    r->addr = c_addr->sin_addr;
+    r->status = status;
+    r->browser_index = req->browser_index;
+    r->bytes = bytes;
+    r->latency_us = latency_us;
+    len = strlen(req->filename);
+    if (len > 0 && req->filename[0] == '.'){   // log the URL path, not "./path"
+        len = len - 1 < LOG_PATH_MAX - 1 ? len - 1 : LOG_PATH_MAX - 1;
+        memcpy(r->path, req->filename + 1, len);
+    } else {
+        len = 1;
+        r->path[0] = '-';
+    }
+    r->path[len] = '\0';
+
+    if (!access_log.threaded){
+        len = format_access_record(line, sizeof(line), r);
+        written(access_log.fd, line, len < sizeof(line) ? len : sizeof(line) - 1);
+        return;
+    }
+    __atomic_store_n(&access_log.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *    Browser and client statistics, shared by every worker and forked
+ *    child. The region is mapped MAP_SHARED before the first fork and
+ *    only ever touched with atomics: counters are fetch-and-add, and the
+ *    recent client ring claims a slot with fetch-and-add on its position,
+ *    stores the address and browser as one 64-bit word, then publishes
+ *    the slot by a release store of its position. A reader skips slots
+ *    not yet published for the position it expects, so it never sees a
+ *    claimed but empty entry. This replaces rewriting recent_browser.txt
+ *    and ip_address.txt on every request.
+ */
+typedef struct {
+    unsigned long requests;
+    unsigned long browsers[6];              // by browser_index, 0 when no User-Agent
+    unsigned long recent_pos;               // total clients ever recorded
+    uint64_t recent[RECENT_CLIENTS];        // s_addr << 32 | browser_index
+    unsigned long recent_seq[RECENT_CLIENTS];   // position + 1 of the entry published in recent[]
+} client_stats;
+
+client_stats *stats = NULL;
+
+// map the shared stats page; call before forking workers or children
+void stats_init(void){
+    void *p = mmap(NULL, sizeof(client_stats), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED){
+        perror("Error mapping client stats");
+        return;
+    }
+    stats = p;
+}
+
+void stats_record(struct sockaddr_in *c_addr, int browser_index){
+    unsigned long pos, slot;
+    if (stats == NULL)
+        return;
+    if (browser_index < 0 || browser_index > 5)
+        browser_index = 0;
+    __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->browsers[browser_index], 1, __ATOMIC_RELAXED);
+    pos = __atomic_fetch_add(&stats->recent_pos, 1, __ATOMIC_RELAXED);
+    slot = pos % RECENT_CLIENTS;
+    __atomic_store_n(&stats->recent[slot],
+                     (uint64_t)c_addr->sin_addr.s_addr << 32 | (unsigned)browser_index,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->recent_seq[slot], pos + 1, __ATOMIC_RELEASE);
+}
+
+// GET /__stats: request counts by browser, then the most recent clients, newest first
+void serve_stats(http_conn *c){
+    char body[2048], ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    unsigned long pos, slot;
+    uint64_t v;
+    int len = 0, i, n;
+
+    if (stats == NULL){
+        client_error(c, 503, "Service Unavailable", "Statistics are not available.");
+        return;
+    }
+    len += sprintf(body + len, "requests %lu\n",
+                   __atomic_load_n(&stats->requests, __ATOMIC_RELAXED));
+    len += sprintf(body + len, "browser - %lu\n",
+                   __atomic_load_n(&stats->browsers[0], __ATOMIC_RELAXED));
+    for (i = 1; i <= 5; i++)
+        len += sprintf(body + len, "browser %s %lu\n", browser_map[i - 1],
+                       __atomic_load_n(&stats->browsers[i], __ATOMIC_RELAXED));
+    pos = __atomic_load_n(&stats->recent_pos, __ATOMIC_RELAXED);
+    n = pos < RECENT_CLIENTS ? pos : RECENT_CLIENTS;
+    for (i = 1; i <= n; i++){
+        slot = (pos - i) % RECENT_CLIENTS;
+        if (__atomic_load_n(&stats->recent_seq[slot], __ATOMIC_ACQUIRE) != pos - i + 1)
+            continue;               // claimed but not written yet, or already reused
+        v = __atomic_load_n(&stats->recent[slot], __ATOMIC_RELAXED);
+        addr.s_addr = (uint32_t)(v >> 32);
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        len += sprintf(body + len, "recent %s %s\n", ip,
+                       (v & 0xff) ? browser_map[(v & 0xff) - 1] : "-");
+    }
+
+    c->status = 200;
+    c->state = CONN_WRITE_RESPONSE;
+    conn_start_head(c, 200, "OK");
+    conn_printf(c, "Content-Type: text/plain\r\nCache-Control: no-store\r\n");
+    conn_printf(c, "Content-length: %d\r\n\r\n", len);
+    conn_printf(c, "%.*s", len, body);
+}
+
+/*
+ *    Request phase timing and counters for /__metrics, built unless
+ *    NO_METRICS is defined. Every worker (and all fork-mode children,
+ *    which share slot 0) owns one slot of an anonymous shared mapping, so
+ *    any worker can render them all. Timings are raw TSC ticks on x86,
+ *    converted with a factor calibrated at startup, and land in
+ *    log-linear HDR-style buckets: 8 sub-buckets per power of two keep
+ *    every recorded value within 12.5% of its bucket.
+ */
+#ifndef NO_METRICS
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)    // up to 2^40 ns, ~18 minutes
+
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long sum_ns;
+} histogram;
+
+typedef struct {
+    histogram phases[METRIC_PHASES];
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long accepted;
+    unsigned long timeouts;                 // connections closed by the timer wheel
+    unsigned long shed;                     // connections and requests turned away with a 503
+    long active;                            // open connections, a gauge
+    unsigned long status[600];              // responses by status code
+} metrics_slot;
+
+static const char *phase_names[METRIC_PHASES] = { "accept", "parse", "open", "header", "body", "total" };
+metrics_slot *metrics_region = NULL;
+metrics_slot *metrics = NULL;               // this process's slot
+int metrics_slots = 0;
+double ns_per_tick = 1.0;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t metrics_ticks(void){
+    return __rdtsc();
+}
+#else
+static inline uint64_t metrics_ticks(void){
+    return (uint64_t)monotonic_ns();
+}
+#endif
+
+// one slot per worker; call before forking anything
+void metrics_init(int slots){
+    uint64_t t0, t1;
+    long long n0, n1;
+    void *p = mmap(NULL, slots * sizeof(metrics_slot), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED){
+        perror("Error mapping metrics");
+        return;
+    }
+    metrics_region = metrics = p;
+    metrics_slots = slots;
+#if defined(__x86_64__) || defined(__i386__)
+    // calibrate the TSC against the monotonic clock over ~10ms
+    n0 = monotonic_ns();
+    t0 = metrics_ticks();
+    usleep(10000);
+    n1 = monotonic_ns();
+    t1 = metrics_ticks();
+    if (t1 > t0)
+        ns_per_tick = (double)(n1 - n0) / (t1 - t0);
+#else
+    (void)t0; (void)t1; (void)n0; (void)n1;
+#endif
+}
+
+// a (re)started worker takes over its slot; its predecessor's connections are gone
+void metrics_use_slot(int index){
+    if (metrics_region == NULL || index >= metrics_slots)
+        return;
+    metrics = &metrics_region[index];
+    __atomic_store_n(&metrics->active, 0, __ATOMIC_RELAXED);
+}
+
+static inline int hist_bucket(uint64_t ns){
+    int msb, i;
+    if (ns < (2 << HIST_SUB_BITS))
+        return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    i = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+        (int)((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// exclusive upper bound of a bucket, in ns
+static uint64_t hist_bucket_limit(int i){
+    int msb, sub;
+    if (i < (2 << HIST_SUB_BITS))
+        return i + 1;
+    msb = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = i & ((1 << HIST_SUB_BITS) - 1);
+    return (uint64_t)((1 << HIST_SUB_BITS) + sub + 1) << (msb - HIST_SUB_BITS);
+}
+
+void metrics_observe_ns(int phase, uint64_t ns){
+    histogram *h;
+    if (metrics == NULL)
+        return;
+    h = &metrics->phases[phase];
+    __atomic_fetch_add(&h->counts[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_observe(int phase, uint64_t ticks){
+    metrics_observe_ns(phase, (uint64_t)(ticks * ns_per_tick));
+}
+
+static inline void metrics_add(unsigned long *counter, long n){
+    if (metrics != NULL)
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// a request is finished: its status, bytes and the phases accumulated on the connection
+void metrics_request_done(http_conn *c){
+    if (metrics == NULL)
+        return;
+    metrics_add(&metrics->requests, 1);
+    metrics_add(&metrics->bytes, c->bytes_sent);
+    if (c->status > 0 && c->status < 600)
+        metrics_add(&metrics->status[c->status], 1);
+    if (c->phase_ticks[PHASE_HEADER])
+        metrics_observe(PHASE_HEADER, c->phase_ticks[PHASE_HEADER]);
+    if (c->phase_ticks[PHASE_BODY])
+        metrics_observe(PHASE_BODY, c->phase_ticks[PHASE_BODY]);
+    metrics_observe_ns(PHASE_TOTAL, monotonic_ns() - c->req_start);
+    memset(c->phase_ticks, 0, sizeof(c->phase_ticks));
+}
+
+// smallest bucket limit covering fraction q of the observations
+static double hist_quantile(unsigned long *counts, unsigned long total, double q){
+    unsigned long want = (unsigned long)(q * total), seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if ((seen += counts[i]) > want)
+            return hist_bucket_limit(i) / 1e9;
+    return hist_bucket_limit(HIST_BUCKETS - 1) / 1e9;
+}
+
+// the fine buckets are folded into these for the Prometheus histogram
+static const double metrics_le[] = { 1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+                                     1e-2, 5e-2, 1e-1, 5e-1, 1, 5 };
+
+static void render_metrics(FILE *out){
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    unsigned long counts[HIST_BUCKETS], cum, total;
+    metrics_slot *m;
+    int w, p, i, b;
+
+    fprintf(out, "# HELP http_requests_total Requests answered.\n# TYPE http_requests_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_requests_total{worker=\"%d\"} %lu\n", w,
+                __atomic_load_n(&metrics_region[w].requests, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_responses_total Responses by status code.\n# TYPE http_responses_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        for (i = 0; i < 600; i++)
+            if (metrics_region[w].status[i])
+                fprintf(out, "http_responses_total{worker=\"%d\",code=\"%d\"} %lu\n", w, i,
+                        __atomic_load_n(&metrics_region[w].status[i], __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_response_bytes_total Response bytes written.\n# TYPE http_response_bytes_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_response_bytes_total{worker=\"%d\"} %lu\n", w,
+                __atomic_load_n(&metrics_region[w].bytes, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_connections_accepted_total Connections accepted.\n# TYPE http_connections_accepted_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_connections_accepted_total{worker=\"%d\"} %lu\n", w,
+                __atomic_load_n(&metrics_region[w].accepted, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_connections_timed_out_total Connections closed for missing a deadline.\n"
+                 "# TYPE http_connections_timed_out_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_connections_timed_out_total{worker=\"%d\"} %lu\n", w,
+                __atomic_load_n(&metrics_region[w].timeouts, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_overload_shed_total Connections and requests answered with an overload 503.\n"
+                 "# TYPE http_overload_shed_total counter\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_overload_shed_total{worker=\"%d\"} %lu\n", w,
+                __atomic_load_n(&metrics_region[w].shed, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP http_connections_active Connections open now.\n# TYPE http_connections_active gauge\n");
+    for (w = 0; w < metrics_slots; w++)
+        fprintf(out, "http_connections_active{worker=\"%d\"} %ld\n", w,
+                __atomic_load_n(&metrics_region[w].active, __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP http_phase_seconds Time spent per request phase.\n# TYPE http_phase_seconds histogram\n");
+    for (w = 0; w < metrics_slots; w++){
+        m = &metrics_region[w];
+        for (p = 0; p < METRIC_PHASES; p++){
+            total = 0;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                total += counts[b] = __atomic_load_n(&m->phases[p].counts[b], __ATOMIC_RELAXED);
+            cum = 0;
+            b = 0;
+            for (i = 0; i < sizeof(metrics_le) / sizeof(metrics_le[0]); i++){
+                while (b < HIST_BUCKETS && hist_bucket_limit(b) <= metrics_le[i] * 1e9)
+                    cum += counts[b++];
+                fprintf(out, "http_phase_seconds_bucket{worker=\"%d\",phase=\"%s\",le=\"%g\"} %lu\n",
+                        w, phase_names[p], metrics_le[i], cum);
+            }
+            fprintf(out, "http_phase_seconds_bucket{worker=\"%d\",phase=\"%s\",le=\"+Inf\"} %lu\n",
+                    w, phase_names[p], total);
+            fprintf(out, "http_phase_seconds_sum{worker=\"%d\",phase=\"%s\"} %.9f\n", w, phase_names[p],
+                    __atomic_load_n(&m->phases[p].sum_ns, __ATOMIC_RELAXED) / 1e9);
+            fprintf(out, "http_phase_seconds_count{worker=\"%d\",phase=\"%s\"} %lu\n",
+                    w, phase_names[p], total);
+        }
+    }
+
+    // the same histograms at full resolution, as the quantiles a dashboard wants
+    fprintf(out, "# HELP http_phase_quantile_seconds Per-phase latency quantiles.\n"
+            "# TYPE http_phase_quantile_seconds gauge\n");
+    for (w = 0; w < metrics_slots; w++){
+        m = &metrics_region[w];
+        for (p = 0; p < METRIC_PHASES; p++){
+            total = 0;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                total += counts[b] = __atomic_load_n(&m->phases[p].counts[b], __ATOMIC_RELAXED);
+            if (total == 0)
+                continue;
+            for (i = 0; i < 3; i++)
+                fprintf(out, "http_phase_quantile_seconds{worker=\"%d\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                        w, phase_names[p], quantiles[i], hist_quantile(counts, total, quantiles[i]));
+        }
+    }
+}
+
+// GET /__metrics: every worker's slot in Prometheus text format
+void serve_metrics(http_conn *c){
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out;
+
+    if (metrics_region == NULL || (out = open_memstream(&body, &len)) == NULL){
+        client_error(c, 503, "Service Unavailable", "Metrics are not available.");
+        return;
+    }
+    render_metrics(out);
+    fclose(out);
+
+    c->status = 200;
+    c->state = CONN_WRITE_RESPONSE;
+    conn_start_head(c, 200, "OK");
+    conn_printf(c, "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n");
+    conn_printf(c, "Content-length: %zu\r\n\r\n", len);
+    conn_printf(c, "%.*s", (int)len, body);
+    free(body);
+}
+
+#define METRIC_START(t) uint64_t t = metrics_ticks()
+#define METRIC_PHASE(phase, t) metrics_observe(phase, metrics_ticks() - (t))
+#define METRIC_ACCUM(c, phase, t) ((c)->phase_ticks[phase] += metrics_ticks() - (t))
+#define METRIC_ADD(field, n) do { if (metrics) __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED); } while (0)
+#define METRIC_REQUEST_DONE(c) metrics_request_done(c)
+#else
+#define METRIC_START(t) do {} while (0)
+#define METRIC_PHASE(phase, t) do {} while (0)
+#define METRIC_ACCUM(c, phase, t) do {} while (0)
+#define METRIC_ADD(field, n) do {} while (0)
+#define METRIC_REQUEST_DONE(c) do {} while (0)
+#endif
+
+// hold (on = 1) or release (on = 0) partial frames for the current response
+static void conn_set_cork(http_conn *c, int on){
+    if (c->corked == on)
+        return;
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        c->corked = on;
+}
+
+// flush the queued response bytes; resumes across EAGAIN the way written() does across EINTR.
+// with more set, a body follows and the head is held back to share its segment.
+// returns 1 when wbuf is empty, 0 if the socket is full, -1 on error
+static int conn_flush(http_conn *c, int more){
+    ssize_t nwritten;
+    int flags = (more && !c->corked) ? MSG_MORE : 0;
+    while (c->woff < c->wlen){
+        if ((nwritten = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, flags)) < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->woff += nwritten;
+        c->bytes_sent += nwritten;
+    }
+    c->woff = c->wlen = 0;
+    return 1;
+}
+
+// splice() fallback for files sendfile() refuses: file -> pipe -> socket,
+// both hops in the kernel. bytes already in the pipe survive an EAGAIN.
+static int send_file_splice(http_conn *c){
+    ssize_t n;
+    size_t len;
+    if (c->pipefd[0] < 0 && pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) < 0){
+        c->pipefd[0] = c->pipefd[1] = -1;
+        return -1;
+    }
+    while (c->file_off < c->file_end || c->pipe_cnt > 0){
+        if (c->pipe_cnt == 0){
+            len = c->file_end - c->file_off;
+            if (len > FILE_CHUNK)
+                len = FILE_CHUNK;
+            n = splice(c->file_fd, &c->file_off, c->pipefd[1], NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;          // file shrank or read failed
+            c->pipe_cnt = n;
+        }
+        n = splice(c->pipefd[0], NULL, c->fd, NULL, c->pipe_cnt,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (n < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->pipe_cnt -= n;
+        c->bytes_sent += n;
+    }
+    return 1;
+}
+
+// zero-copy body: sendfile() straight from the page cache, resumable across EAGAIN.
+// returns 1 when the body is sent, 0 if the socket is full, -1 on error
+static int send_file_body(http_conn *c){
+    ssize_t n;
+    size_t len;
+    while (!c->use_splice && c->file_off < c->file_end){
+        len = c->file_end - c->file_off;
+        if (len > FILE_CHUNK)
+            len = FILE_CHUNK;
+        if ((n = sendfile(c->fd, c->file_fd, &c->file_off, len)) > 0){
+            c->bytes_sent += n;
+            continue;
+        }
+        if (n == 0)
+            return -1;              // file shrank under us
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+        c->use_splice = 1;          // this file can't be sendfile()d
+    }
+    if (c->use_splice)
+        return send_file_splice(c);
+    return 1;
+}
+
+// append v in lower case hex, no leading zeros; returns the end
+static char *put_hex(char *p, unsigned long long v){
+    char buf[16], *q = buf + sizeof(buf);
+    do {
+        *--q = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+    memcpy(p, q, buf + sizeof(buf) - q);
+    return p + (buf + sizeof(buf) - q);
+}
+
+// derive the strong ETag and Last-Modified of a file version from its stat
+void make_validators(struct stat *st, file_validators *v){
+    char *p = v->etag;
+    *p++ = '"';
+    p = put_hex(p, st->st_ino);
+    *p++ = '-';
+    p = put_hex(p, st->st_size);
+    *p++ = '-';
+    p = put_hex(p, (unsigned long long)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec);
+    *p++ = '"';
+    *p = '\0';
+    format_http_date(v->last_modified, st->st_mtime);
+    v->mtime = st->st_mtime;
+}
+
+// validators of a coded variant: its own ETag, so a cache never mixes it up with the file as is
+static void make_encoded_validators(struct stat *st, int encoding, file_validators *v){
+    size_t n;
+    make_validators(st, v);
+    if (encoding && (n = strlen(v->etag)) > 0)
+        snprintf(v->etag + n - 1, sizeof(v->etag) - n + 1, "-%s\"", encoding_name(encoding));
+}
+
+// does an If-None-Match list name etag? weak comparison: a W/ prefix is ignored
+static int etag_list_matches(http_slice list, const char *etag){
+    const char *p = list.p, *end = list.p + list.len, *comma;
+    size_t n = strlen(etag);
+    http_slice t;
+    while (p < end){
+        if ((comma = find_byte(p, end, ',')) == NULL)
+            comma = end;
+        t.p = p;
+        t.len = comma - p;
+        while (t.len && is_ows(*t.p)){ t.p++; t.len--; }
+        while (t.len && is_ows(t.p[t.len - 1])) t.len--;
+        if (t.len == 1 && *t.p == '*')
+            return 1;
+        if (t.len > 2 && t.p[0] == 'W' && t.p[1] == '/'){ t.p += 2; t.len -= 2; }
+        if (t.len == n && memcmp(t.p, etag, n) == 0)
+            return 1;
+        p = comma + 1;
+    }
+    return 0;
+}
+
+/*
+ *    RFC 7232 evaluation for a GET: If-None-Match wins when present,
+ *    otherwise If-Modified-Since is compared with the file's mtime.
+ *    Browsers echo our Last-Modified back verbatim, so an exact string
+ *    match settles it without parsing a date.
+ */
+int not_modified(http_request *req, file_validators *v){
+    char date[64];
+    struct tm tm;
+    if (req->if_none_match.p)
+        return etag_list_matches(req->if_none_match, v->etag);
+    if (req->if_modified_since.p == NULL)
+        return 0;
+    if (slice_eq(req->if_modified_since, v->last_modified))
+        return 1;
+    if (req->if_modified_since.len >= sizeof(date))
+        return 0;
+    memcpy(date, req->if_modified_since.p, req->if_modified_since.len);
+    date[req->if_modified_since.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return 0;                   // unparsable dates are ignored
+    return v->mtime <= timegm(&tm);
+}
+
+// header-only 304 carrying the validators the client should keep using
+void queue_not_modified(http_conn *c, file_validators *v){
+    c->status = 304;
+    c->state = CONN_WRITE_RESPONSE;
+    conn_start_head(c, 304, "Not Modified");
+    conn_append_validators(c, v);
+    conn_append_lit(c, "\r\n");
+}
+
+// parse a digit run into *v; returns the first byte after it, NULL if there are no digits or it overflows
+static const char *parse_offset(const char *p, const char *end, off_t *v){
+    const char *start = p;
+    *v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++){
+        if (*v > (INT64_MAX - 9) / 10)
+            return NULL;
+        *v = *v * 10 + (*p - '0');
+    }
+    return p == start ? NULL : p;
+}
+
+/*
+ *    Resolve a "Range: bytes=..." header against a file of size bytes
+ *    (RFC 7233). Handles "a-b", open-ended "a-" and suffix "-n" specs,
+ *    clamping ends to the file. Returns the number of satisfiable ranges
+ *    stored in out, 0 if the header should be ignored (malformed, not
+ *    bytes, or more than max ranges) and -1 if nothing is satisfiable.
+ */
+int parse_range(http_slice range, off_t size, byte_range *out, int max){
+    const char *p = range.p, *end = range.p + range.len, *comma;
+    int n = 0, specs = 0;
+    off_t first, last;
+
+    if (range.len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return 0;
+    for (p += 6; p < end; p = comma + 1){
+        if ((comma = find_byte(p, end, ',')) == NULL)
+            comma = end;
+        while (p < comma && is_ows(*p))
+            p++;
+        if (p == comma)
+            continue;               // empty list element
+        specs++;
+        if (*p == '-'){             // suffix: the last n bytes
+            if ((p = parse_offset(p + 1, comma, &last)) == NULL)
+                return 0;
+            if (last == 0 || size == 0)
+                goto next;
+            first = size > last ? size - last : 0;
+            last = size - 1;
+        } else {
+            if ((p = parse_offset(p, comma, &first)) == NULL || p == comma || *p != '-')
+                return 0;
+            p++;
+            last = size - 1;        // open-ended
+            if (p < comma && !is_ows(*p)){
+                if ((p = parse_offset(p, comma, &last)) == NULL)
+                    return 0;
+                if (last < first)
+                    return 0;
+                if (last > size - 1)
+                    last = size - 1;
+            }
+            if (first >= size)
+                goto next;          // starts past the end: unsatisfiable
+        }
+        if (n == max)
+            return 0;
+        out[n].start = first;
+        out[n].end = last + 1;
+        n++;
+    next:
+        while (p < comma && is_ows(*p))
+            p++;
+        if (p != comma)
+            return 0;
+    }
+    if (specs == 0)
+        return 0;
+    return n ? n : -1;
+}
+
+// separates the parts of multipart/byteranges bodies from this process
+static const char *range_boundary(void){
+    static char boundary[32];
+    if (boundary[0] == '\0')
+        snprintf(boundary, sizeof(boundary), "%08lx%08x", (unsigned long)time(NULL), (unsigned)getpid());
+    return boundary;
+}
+
+// queue the head of multipart part i (or the closing delimiter when i == nranges)
+static int queue_range_part(http_conn *c, int i, off_t total_size, const char *type){
+    if (i == c->nranges)
+        return conn_printf(c, "\r\n--%s--\r\n", range_boundary());
+    return conn_printf(c, "\r\n--%s\r\nContent-type: %s\r\nContent-range: bytes %lld-%lld/%lld\r\n\r\n",
+                       range_boundary(), type, (long long)c->ranges[i].start,
+                       (long long)c->ranges[i].end - 1, (long long)total_size);
+}
+
+// serve static content.
+// the first call queues the response head and takes ownership of in_fd; every
+// later call streams as much of the body as the socket accepts. a Range
+// header turns the response into a 206 (one range), a multipart/byteranges
+// 206 (several) or a 416; every part is sent zero-copy from its offset.
+// returns 1 when the whole body is sent, 0 if the socket is full, -1 on error
+int serve_static(http_conn *c, int in_fd, http_request *req,
+                  size_t total_size){
+    const char* type;
+    int rc, i;
+
+    type = get_mime_type(req -> filename);
+    if (c->state != CONN_SEND_FILE){
+        // send response headers to client e.g., "HTTP/1.1 200 OK\r\n"
+        c->file_fd = in_fd;
+        c->file_size = total_size;
+        c->state = CONN_SEND_FILE;
+        c->nranges = req->range.p ? parse_range(req->range, total_size, c->ranges, MAX_RANGES) : 0;
+
+        if (c->nranges < 0){
+            c->status = 416;
+            c->nranges = 0;
+            c->file_off = c->file_end = 0;
+            conn_start_head(c, 416, "Range Not Satisfiable");
+            conn_printf(c, "Content-range: bytes */%lu\r\nContent-length: 0\r\n\r\n", total_size);
+        } else if (c->nranges == 0){
+            c->file_off = 0;
+            c->file_end = total_size;
+            // the 200 template, with only validators, length and type patched in
+            conn_start_head(c, 200, "OK");
+            if (c->encoding){       // a precompressed sibling: no ranges on the coded bytes
+                conn_append_lit(c, "Content-Encoding: ");
+                conn_append_str(c, encoding_name(c->encoding));
+                conn_append_lit(c, "\r\n");
+            } else {
+                conn_append_lit(c, "Accept-Ranges: bytes\r\n");
+            }
+            if (compressible(type))
+                conn_append_lit(c, "Vary: Accept-Encoding\r\n");
+            conn_append_validators(c, &c->validators);
+            conn_append_lit(c, "Content-length: ");
+            conn_append_num(c, total_size);
+            conn_append_lit(c, "\r\nContent-type: ");
+            conn_append_str(c, type);
+            conn_append_lit(c, "\r\n\r\n");
+        } else if (c->nranges == 1){
+            c->status = 206;
+            req->offset = c->file_off = c->ranges[0].start;
+            req->end = c->file_end = c->ranges[0].end;
+            conn_start_head(c, 206, "Partial Content");
+            conn_append_lit(c, "Accept-Ranges: bytes\r\n");
+            conn_append_validators(c, &c->validators);
+            conn_printf(c, "Content-range: bytes %lld-%lld/%lu\r\n", (long long)c->file_off,
+                        (long long)c->file_end - 1, total_size);
+            conn_printf(c, "Content-length: %lld\r\n", (long long)(c->file_end - c->file_off));
+            conn_printf(c, "Content-type: %s\r\n\r\n", type);
+        } else {
+            // multipart: the length covers every part head, every range and the closing delimiter
+            long long length = 0;
+            size_t mark = c->wlen;
+            for (i = 0; i <= c->nranges; i++){
+                queue_range_part(c, i, total_size, type);
+                if (i < c->nranges)
+                    length += c->ranges[i].end - c->ranges[i].start;
+            }
+            length += c->wlen - mark;
+            c->wlen = mark;         // only measured; each part head is queued when its turn comes
+            c->status = 206;
+            c->cur_range = -1;
+            c->file_off = c->file_end = 0;
+            conn_start_head(c, 206, "Partial Content");
+            conn_append_lit(c, "Accept-Ranges: bytes\r\n");
+            conn_append_validators(c, &c->validators);
+            conn_printf(c, "Content-length: %lld\r\n", length);
+            conn_printf(c, "Content-type: multipart/byteranges; boundary=%s\r\n\r\n", range_boundary());
+        }
+        if (config.cork && (c->file_off < c->file_end || c->nranges > 1))
+            conn_set_cork(c, 1);
+        log_debug("serving static file, fd = %d", c->fd);
+    }
+
+    while (1){
+        // the head leaves in the same segment as the start of the body
+        METRIC_START(t_head);
+        rc = conn_flush(c, c->file_off < c->file_end);
+        METRIC_ACCUM(c, PHASE_HEADER, t_head);
+        if (rc <= 0)
+            return rc;
+        METRIC_START(t_body);
+        rc = send_file_body(c);
+        METRIC_ACCUM(c, PHASE_BODY, t_body);
+        if (rc <= 0)
+            return rc;
+        if (c->nranges < 2 || c->cur_range == c->nranges)
+            break;
+        // multipart: on to the next part, or the closing delimiter after the last
+        if (++c->cur_range < c->nranges){
+            c->file_off = c->ranges[c->cur_range].start;
+            c->file_end = c->ranges[c->cur_range].end;
+        }
+        queue_range_part(c, c->cur_range, total_size, type);
+    }
+    conn_set_cork(c, 0);            // push out the final partial segment
+    return 1;
+}
+
+/*
+ *    Docroot index (--index=PATH). The startup pass records every
+ *    regular file and directory under the document root with its inode,
+ *    size and mtime in a file sorted by path. Those three fields are what
+ *    make_validators() builds the ETag from. Every process maps the file
+ *    shared. On a restart the pass reuses the previous run's index: it
+ *    re-stats each entry in parallel and reads only the directories whose
+ *    mtime moved, so it costs one stat per file instead of a full walk.
+ *
+ *    While serving, a process that watches every indexed directory
+ *    answers a conditional request for an indexed file from the index
+ *    alone, with no open() or fstat(). inotify events mark changed
+ *    entries stale, and stale entries go the ordinary way until the next
+ *    start. Requests bump a per-entry counter, which is halved at every
+ *    start so it tracks recent traffic. --prewarm=N reads the N most
+ *    requested files into the page cache before the first connection.
+ */
+#define INDEX_MAGIC "tsindex1"
+#define INDEX_THREADS 16            // most threads walking the docroot or prewarming
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// the index file: this header, count index_entry sorted by name, then the names
+typedef struct {
+    char magic[8];
+    uint64_t dev;               // the docroot it describes
+    uint64_t ino;
+    uint32_t count;
+    uint32_t names_len;
+} index_header;
+
+static struct {
+    index_header *map;          // the mapped file, NULL without an index
+    size_t map_len;
+    index_entry *entries;
+    const char *names;
+    uint32_t count;
+    int watched;                // this process watches every indexed directory: entries are trusted
+    int *wd_dir;                // inotify wd -> entry of the directory it watches, -1 if none
+    int nwd;
+} docroot_index;
+
+// an entry found during the startup pass, before the table is written
+typedef struct {
+    char *name;
+    index_entry e;
+} index_rec;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char **dirs;                // directories still to read
+    size_t ndirs, dirs_cap;
+    int busy;                   // threads reading one; they may queue more
+    index_rec *recs;
+    size_t nrecs, recs_cap;
+    index_entry *old;           // the previous run's index, to reuse
+    const char *old_names;
+    uint32_t old_count;
+} index_walk = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// first of count entries whose name is not less than key
+static uint32_t index_lower_bound(const index_entry *entries, const char *names, uint32_t count,
+                                  const char *key){
+    uint32_t lo = 0, hi = count, mid;
+    while (lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(names + entries[mid].name, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static index_entry *index_search(index_entry *entries, const char *names, uint32_t count, const char *key){
+    uint32_t i = index_lower_bound(entries, names, count, key);
+    return i < count && strcmp(names + entries[i].name, key) == 0 ? &entries[i] : NULL;
+}
+
+// the index entry of path, trusted or not; NULL if it isn't indexed
+static index_entry *index_lookup(const char *path){
+    if (docroot_index.map == NULL)
+        return NULL;
+    return index_search(docroot_index.entries, docroot_index.names, docroot_index.count, path);
+}
+
+// one more request for e. plain increments: a lost update between workers only blurs the ranking
+static inline void index_hit(index_entry *e){
+    if (e != NULL && e->hits < UINT32_MAX)
+        e->hits++;
+}
+
+// can e stand in for an fstat() of its file right now?
+static int index_trusted(const index_entry *e){
+    return docroot_index.watched && !e->stale && S_ISREG(e->mode);
+}
+
+// the stat fields the validators and the response head use
+static void index_stat(const index_entry *e, struct stat *st){
+    memset(st, 0, sizeof(*st));
+    st->st_mode = e->mode;
+    st->st_ino = e->ino;
+    st->st_size = e->size;
+    st->st_mtim.tv_sec = e->mtime_ns / 1000000000;
+    st->st_mtim.tv_nsec = e->mtime_ns % 1000000000;
+}
+
+// record one file or directory found by the startup pass; directories get read in turn
+static void index_add(const char *name, struct stat *st){
+    index_entry *old;
+    index_rec *r;
+    char **d;
+    pthread_mutex_lock(&index_walk.lock);
+    if (index_walk.nrecs == index_walk.recs_cap){
+        index_walk.recs_cap = index_walk.recs_cap ? index_walk.recs_cap * 2 : 4096;
+        if ((r = realloc(index_walk.recs, index_walk.recs_cap * sizeof(index_rec))) == NULL)
+            goto out;
+        index_walk.recs = r;
+    }
+    r = &index_walk.recs[index_walk.nrecs];
+    if ((r->name = strdup(name)) == NULL)
+        goto out;
+    memset(&r->e, 0, sizeof(r->e));
+    r->e.ino = st->st_ino;
+    r->e.size = st->st_size;
+    r->e.mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    r->e.mode = st->st_mode;
+    if ((old = index_search(index_walk.old, index_walk.old_names, index_walk.old_count, name)) != NULL)
+        r->e.hits = old->hits / 2;  // age the counts so they follow recent traffic
+    index_walk.nrecs++;
+    if (S_ISDIR(st->st_mode)){
+        if (index_walk.ndirs == index_walk.dirs_cap){
+            index_walk.dirs_cap = index_walk.dirs_cap ? index_walk.dirs_cap * 2 : 256;
+            if ((d = realloc(index_walk.dirs, index_walk.dirs_cap * sizeof(char *))) == NULL)
+                goto out;
+            index_walk.dirs = d;
+        }
+        index_walk.dirs[index_walk.ndirs++] = r->name;  // owned by the record
+        pthread_cond_signal(&index_walk.changed);
+    }
+out:
+    pthread_mutex_unlock(&index_walk.lock);
+}
+
+// stat name in directory dir (open as dfd) and record it if it is a file or directory
+static void index_stat_child(int dfd, const char *dir, const char *name){
+    char path[PATH_MAX];
+    struct stat st;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        return;                     // symlinks stay out; open_beneath() decides on them per request
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) < (int)sizeof(path))
+        index_add(path, &st);
+}
+
+// read one directory: from disk if it changed since the last index, else from that index
+static void index_scan_dir(const char *dir){
+    char prefix[PATH_MAX], dents[DENTS_BUFSIZE];
+    struct dirent64 *entry;
+    index_entry *old;
+    const char *name;
+    struct stat st;
+    size_t len;
+    ssize_t n, pos;
+    uint32_t i;
+    int dfd;
+
+    if ((dfd = open_beneath(dir, O_RDONLY | O_DIRECTORY)) < 0)
+        return;
+    len = snprintf(prefix, sizeof(prefix), "%s/", dir);
+    if (fstat(dfd, &st) == 0 && len < sizeof(prefix) &&
+        (old = index_search(index_walk.old, index_walk.old_names, index_walk.old_count, dir)) != NULL &&
+        old->ino == st.st_ino && old->mtime_ns == (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec){
+        // same names as last time; every one is still stat()ed, contents change without the directory
+        for (i = index_lower_bound(index_walk.old, index_walk.old_names, index_walk.old_count, prefix);
+             i < index_walk.old_count; i++){
+            name = index_walk.old_names + index_walk.old[i].name;
+            if (strncmp(name, prefix, len) != 0)
+                break;
+            if (strchr(name + len, '/') == NULL)    // deeper ones belong to subdirectories
+                index_stat_child(dfd, dir, name + len);
+        }
+    } else {
+        while ((n = getdents64(dfd, dents, sizeof(dents))) > 0){
+            for (pos = 0; pos < n; pos += entry->d_reclen){
+                entry = (struct dirent64 *)(dents + pos);
+                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                    index_stat_child(dfd, dir, entry->d_name);
+            }
+        }
+    }
+    close(dfd);
+}
+
+static void *index_walker(void *arg){
+    char *dir;
+    (void)arg;
+    pthread_mutex_lock(&index_walk.lock);
+    while (1){
+        while (index_walk.ndirs == 0 && index_walk.busy > 0)
+            pthread_cond_wait(&index_walk.changed, &index_walk.lock);
+        if (index_walk.ndirs == 0)
+            break;                  // nothing queued and nobody left to queue more
+        dir = index_walk.dirs[--index_walk.ndirs];
+        index_walk.busy++;
+        pthread_mutex_unlock(&index_walk.lock);
+        index_scan_dir(dir);
+        pthread_mutex_lock(&index_walk.lock);
+        index_walk.busy--;
+    }
+    pthread_cond_broadcast(&index_walk.changed);
+    pthread_mutex_unlock(&index_walk.lock);
+    return NULL;
+}
+
+static int index_rec_cmp(const void *a, const void *b){
+    return strcmp(((const index_rec *)a)->name, ((const index_rec *)b)->name);
+}
+
+// how many threads the startup pass runs
+static int index_threads(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > INDEX_THREADS ? INDEX_THREADS : (int)n;
+}
+
+// map an index file for the docroot described by root; NULL if missing, damaged or another root's
+static index_header *index_map(const char *path, struct stat *root, int writable, size_t *len){
+    index_header *h;
+    index_entry *e;
+    struct stat st;
+    uint32_t i;
+    int fd;
+    if ((fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(index_header) ||
+        (h = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0)) == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *len = st.st_size;
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 || h->dev != root->st_dev || h->ino != root->st_ino ||
+        sizeof(index_header) + (size_t)h->count * sizeof(index_entry) + h->names_len != *len ||
+        h->names_len == 0 || ((char *)h)[*len - 1] != '\0'){
+        munmap(h, *len);
+        return NULL;
+    }
+    for (i = 0, e = (index_entry *)(h + 1); i < h->count; i++)
+        if (e[i].name >= h->names_len){
+            munmap(h, *len);
+            return NULL;
+        }
+    return h;
+}
+
+// write the sorted records to path (through a temporary file and a rename)
+static int index_write(const char *path, struct stat *root){
+    char tmp[PATH_MAX];
+    index_header h;
+    size_t names_len = 0, i, off;
+    char *p;
+    int fd;
+
+    qsort(index_walk.recs, index_walk.nrecs, sizeof(index_rec), index_rec_cmp);
+    for (i = 0; i < index_walk.nrecs; i++)
+        names_len += strlen(index_walk.recs[i].name) + 1;
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.dev = root->st_dev;
+    h.ino = root->st_ino;
+    h.count = index_walk.nrecs;
+    h.names_len = names_len;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if ((p = malloc(names_len)) == NULL){
+        close(fd);
+        return -1;
+    }
+    for (i = off = 0; i < index_walk.nrecs; i++){
+        index_walk.recs[i].e.name = off;
+        off += strlen(strcpy(p + off, index_walk.recs[i].name)) + 1;
+    }
+    // header, then the entries one by one out of the records, then the names
+    if (write(fd, &h, sizeof(h)) != sizeof(h))
+        goto fail;
+    for (i = 0; i < index_walk.nrecs; i++)
+        if (write(fd, &index_walk.recs[i].e, sizeof(index_entry)) != sizeof(index_entry))
+            goto fail;
+    if (write(fd, p, names_len) != (ssize_t)names_len || rename(tmp, path) < 0)
+        goto fail;
+    free(p);
+    close(fd);
+    return 0;
+fail:
+    free(p);
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ *    Build or refresh the index at path and map it for this process and
+ *    every one forked after. A run with nothing to reuse reads every
+ *    directory. Returns -1, serving on without an index, if the file
+ *    can't be written.
+ */
+int docroot_index_build(const char *path){
+    pthread_t tids[INDEX_THREADS];
+    index_header *old;
+    struct stat root;
+    long long start = monotonic_ns();
+    size_t old_len = 0, i;
+    int n, nthreads = index_threads();
+
+    if (fstat(docroot_fd, &root) < 0)
+        return -1;
+    if ((old = index_map(path, &root, 0, &old_len)) != NULL){
+        index_walk.old = (index_entry *)(old + 1);
+        index_walk.old_count = old->count;
+        index_walk.old_names = (const char *)(index_walk.old + old->count);
+    }
+    index_add(".", &root);
+    for (n = 0; n < nthreads; n++)
+        if (pthread_create(&tids[n], NULL, index_walker, NULL) != 0)
+            break;
+    if (n == 0)
+        index_walker(NULL);         // walk it here then
+    while (n > 0)
+        pthread_join(tids[--n], NULL);
+
+    if (index_write(path, &root) < 0)
+        perror("Error writing the docroot index");
+    else if ((docroot_index.map = index_map(path, &root, 1, &docroot_index.map_len)) != NULL){
+        docroot_index.count = docroot_index.map->count;
+        docroot_index.entries = (index_entry *)(docroot_index.map + 1);
+        docroot_index.names = (const char *)(docroot_index.entries + docroot_index.count);
+        log_info("docroot index: %u entries, %s, in %lld ms", docroot_index.count,
+                 old ? "refreshed" : "built", (monotonic_ns() - start) / 1000000);
+    }
+    if (old)
+        munmap(old, old_len);
+    for (i = 0; i < index_walk.nrecs; i++)
+        free(index_walk.recs[i].name);
+    free(index_walk.recs);
+    free(index_walk.dirs);
+    index_walk.recs = NULL;
+    index_walk.dirs = NULL;
+    index_walk.old = NULL;
+    return docroot_index.map ? 0 : -1;
+}
+
+static int index_hits_cmp(const void *a, const void *b){
+    uint32_t x = docroot_index.entries[*(const uint32_t *)a].hits;
+    uint32_t y = docroot_index.entries[*(const uint32_t *)b].hits;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static uint32_t *prewarm_list;
+static int prewarm_count, prewarm_next;
+
+static void *index_prewarmer(void *arg){
+    int i, fd;
+    index_entry *e;
+    (void)arg;
+    while ((i = __atomic_fetch_add(&prewarm_next, 1, __ATOMIC_RELAXED)) < prewarm_count){
+        e = &docroot_index.entries[prewarm_list[i]];
+        if ((fd = open_beneath(docroot_index.names + e->name, O_RDONLY)) < 0)
+            continue;
+        readahead(fd, 0, e->size);
+        close(fd);
+    }
+    return NULL;
+}
+
+// read the n most requested files of the last runs into the page cache, in parallel
+void docroot_index_prewarm(int n){
+    pthread_t tids[INDEX_THREADS];
+    long long start = monotonic_ns(), bytes = 0;
+    uint32_t i;
+    int t, nthreads = index_threads();
+
+    if (docroot_index.map == NULL || (prewarm_list = malloc(docroot_index.count * sizeof(uint32_t))) == NULL)
+        return;
+    for (i = 0; i < docroot_index.count; i++)
+        if (S_ISREG(docroot_index.entries[i].mode) && docroot_index.entries[i].hits > 0)
+            prewarm_list[prewarm_count++] = i;
+    qsort(prewarm_list, prewarm_count, sizeof(uint32_t), index_hits_cmp);
+    if (prewarm_count > n)
+        prewarm_count = n;
+    for (t = 0; t < nthreads; t++)
+        if (pthread_create(&tids[t], NULL, index_prewarmer, NULL) != 0)
+            break;
+    if (t == 0)
+        index_prewarmer(NULL);
+    while (t > 0)
+        pthread_join(tids[--t], NULL);
+    for (t = 0; t < prewarm_count; t++)
+        bytes += docroot_index.entries[prewarm_list[t]].size;
+    log_info("prewarmed %d files, %lld KB, in %lld ms", prewarm_count, bytes >> 10,
+             (monotonic_ns() - start) / 1000000);
+    free(prewarm_list);
+}
+
+// watch every indexed directory on this process's inotify descriptor; the
+// entries are only trusted once all of them are watched
+void docroot_index_watch(int inotify_fd){
+    uint32_t i;
+    int wd, *p;
+    if (docroot_index.map == NULL || inotify_fd < 0)
+        return;
+    for (i = 0; i < docroot_index.count; i++){
+        if (!S_ISDIR(docroot_index.entries[i].mode))
+            continue;
+        if ((wd = inotify_add_watch(inotify_fd, docroot_index.names + docroot_index.entries[i].name,
+                                    WATCH_EVENTS)) < 0){
+            log_warn("docroot index: can't watch %s (%s), answering from disk",
+                     docroot_index.names + docroot_index.entries[i].name, strerror(errno));
+            return;
+        }
+        if (wd >= docroot_index.nwd){
+            if ((p = realloc(docroot_index.wd_dir, (wd + 1024) * sizeof(int))) == NULL)
+                return;
+            memset(p + docroot_index.nwd, -1, (wd + 1024 - docroot_index.nwd) * sizeof(int));
+            docroot_index.wd_dir = p;
+            docroot_index.nwd = wd + 1024;
+        }
+        docroot_index.wd_dir[wd] = i;
+    }
+    docroot_index.watched = 1;
+}
+
+// mark path, and everything beneath it if it is a directory, changed
+static void index_mark_stale(const char *path){
+    char prefix[PATH_MAX];
+    const char *names = docroot_index.names;
+    index_entry *e;
+    size_t len;
+    uint32_t i;
+    if ((e = index_lookup(path)) != NULL)
+        e->stale = 1;
+    if ((len = snprintf(prefix, sizeof(prefix), "%s/", path)) >= sizeof(prefix))
+        return;
+    e = docroot_index.entries;
+    for (i = index_lower_bound(e, names, docroot_index.count, prefix);
+         i < docroot_index.count && strncmp(names + e[i].name, prefix, len) == 0; i++)
+        e[i].stale = 1;
+}
+
+// an inotify event from the content cache's descriptor that may concern an indexed directory
+static void docroot_index_event(const struct inotify_event *ev){
+    char path[PATH_MAX];
+    const char *dir;
+    int i;
+    if (!docroot_index.watched)
+        return;
+    if (ev->mask & IN_Q_OVERFLOW){
+        docroot_index.watched = 0;  // changes went unseen; stop trusting the index here
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= docroot_index.nwd || (i = docroot_index.wd_dir[ev->wd]) < 0)
+        return;
+    dir = docroot_index.names + docroot_index.entries[i].name;
+    if (ev->len == 0)
+        index_mark_stale(dir);      // the directory itself went away or moved
+    else if (snprintf(path, sizeof(path), "%s/%s", dir, ev->name) < (int)sizeof(path))
+        index_mark_stale(path);
+}
+
+// watched directory; inotify hands out one wd per directory inode
+typedef struct {
+    int wd;
+    cache_entry *entries;       // cached files in this directory
+} cache_watch;
+
+// per-process content cache: hash table + LRU list under a byte budget
+typedef struct {
+    cache_entry **buckets;      // NULL while the cache is disabled
+    size_t nbuckets;            // power of two
+    size_t bytes;               // charged bytes of linked entries
+    cache_entry *lru_head;
+    cache_entry *lru_tail;
+    int inotify_fd;             // -1 if unavailable; entries then stat() once a second
+    cache_watch *watches;
+    int nwatches;
+    unsigned long hits, misses, evictions;
+} content_cache;
+
+content_cache file_cache = { NULL, 0, 0, NULL, NULL, -1, NULL, 0, 0, 0, 0 };
+
+static unsigned hash_path(const char *s){
+    unsigned h = 2166136261u;   // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// set up the cache for this process; the event loop watches the returned inotify fd
+int file_cache_init(void){
+    size_t n = 1024;
+    if (config.cache_bytes == 0)
+        return -1;
+    while (n < (1 << 20) && n * 4096 < config.cache_bytes)  // ~one bucket per 4K of budget
+        n *= 2;
+    if ((file_cache.buckets = calloc(n, sizeof(cache_entry *))) == NULL)
+        return -1;
+    file_cache.nbuckets = n;
+    if ((file_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        perror("inotify unavailable, cache revalidates with stat()");
+    return file_cache.inotify_fd;
+}
+
+static cache_watch *cache_find_watch(int wd){
+    int i;
+    for (i = 0; i < file_cache.nwatches; i++)
+        if (file_cache.watches[i].wd == wd)
+            return &file_cache.watches[i];
+    return NULL;
+}
+
+// watch the directory holding key so edits there invalidate the entry
+static int cache_watch_dir(cache_entry *e){
+    char dir[512];
+    size_t len = e->name - e->key;
+    cache_watch *w, *p;
+    int wd;
+    if (file_cache.inotify_fd < 0 || len == 0 || len >= sizeof(dir))
+        return -1;
+    memcpy(dir, e->key, len);
+    dir[len] = '\0';
+    wd = inotify_add_watch(file_cache.inotify_fd, dir, WATCH_EVENTS);
+    if (wd < 0)
+        return -1;
+    if ((w = cache_find_watch(wd)) == NULL){
+        if ((p = realloc(file_cache.watches, (file_cache.nwatches + 1) * sizeof(cache_watch))) == NULL)
+            return -1;
+        file_cache.watches = p;
+        w = &file_cache.watches[file_cache.nwatches++];
+        w->wd = wd;
+        w->entries = NULL;
+    }
+    e->wprev = NULL;
+    e->wnext = w->entries;
+    if (w->entries)
+        w->entries->wprev = e;
+    w->entries = e;
+    return wd;
+}
+
+static void cache_entry_free(cache_entry *e){
+    free(e->key);
+    free(e->body);
+    free(e);
+}
+
+// drop e from the table; connections still sending it keep it until released
+static void cache_unlink(cache_entry *e){
+    cache_entry **pp = &file_cache.buckets[e->hash & (file_cache.nbuckets - 1)];
+    cache_watch *w;
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else file_cache.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else file_cache.lru_tail = e->lru_prev;
+    if (e->wd >= 0 && (w = cache_find_watch(e->wd)) != NULL){
+        if (e->wprev) e->wprev->wnext = e->wnext; else w->entries = e->wnext;
+        if (e->wnext) e->wnext->wprev = e->wprev;
+    }
+    file_cache.bytes -= e->charge;
+    e->linked = 0;
+    if (e->refs == 0)
+        cache_entry_free(e);
+}
+
+void cache_release(cache_entry *e){
+    if (--e->refs == 0 && !e->linked)
+        cache_entry_free(e);
+}
+
+static int cache_stat_matches(cache_entry *e, struct stat *st){
+    return st->st_ino == e->ino && st->st_dev == e->dev && st->st_size == e->size &&
+           st->st_mtim.tv_sec == e->mtime.tv_sec && st->st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+// find a fresh entry for path in the given ENC_* coding (0: as is). watched
+// entries cost no syscalls at all; unwatched ones are re-stat()ed at most once a
+// second, against the file the body was read from
+cache_entry *file_cache_lookup_encoded(const char *path, int encoding){
+    cache_entry *e;
+    unsigned h;
+    struct stat st;
+    time_t now;
+    char sibling[PATH_MAX];
+    if (file_cache.buckets == NULL)
+        return NULL;
+    h = hash_path(path);
+    for (e = file_cache.buckets[h & (file_cache.nbuckets - 1)]; e; e = e->hnext)
+        if (e->hash == h && e->encoding == encoding && strcmp(e->key, path) == 0)
+            break;
+    if (e == NULL){
+        file_cache.misses++;
+        return NULL;
+    }
+    if (e->wd < 0 && (now = monotonic_seconds()) != e->checked){
+        if (e->stat_ext != NULL)
+            snprintf(sibling, sizeof(sibling), "%s%s", path, e->stat_ext);
+        if (stat(e->stat_ext ? sibling : path, &st) < 0 || !cache_stat_matches(e, &st)){
+            cache_unlink(e);
+            file_cache.misses++;
+            return NULL;
+        }
+        e->checked = now;
+    }
+    // move to the front of the LRU list
+    if (e != file_cache.lru_head){
+        e->lru_prev->lru_next = e->lru_next;
+        if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else file_cache.lru_tail = e->lru_prev;
+        e->lru_prev = NULL;
+        e->lru_next = file_cache.lru_head;
+        file_cache.lru_head->lru_prev = e;
+        file_cache.lru_head = e;
+    }
+    file_cache.hits++;
+    return e;
+}
+
+cache_entry *file_cache_lookup(const char *path){
+    return file_cache_lookup_encoded(path, 0);
+}
+
+// add a rendered body for path, st being the stat of the file (or directory)
+// it came from and encoding its ENC_* coding. takes ownership of body; evicts
+// the least recently used entries to stay within budget. returns NULL if it doesn't fit
+static cache_entry *file_cache_add(const char *path, struct stat *st, char *body, size_t body_len,
+                                   const char *mime_type, int encoding){
+    cache_entry *e, **bucket;
+    size_t charge = sizeof(cache_entry) + strlen(path) + 1 + body_len;
+    const char *slash;
+
+    if (charge > config.cache_bytes || (e = calloc(1, sizeof(cache_entry))) == NULL){
+        free(body);
+        return NULL;
+    }
+    e->body = body;
+    if ((e->key = strdup(path)) == NULL){
+        cache_entry_free(e);
+        return NULL;
+    }
+    slash = strrchr(e->key, '/');
+    e->name = slash ? slash + 1 : e->key;   // "" for a directory listing
+    e->hash = hash_path(path);
+    e->body_len = body_len;
+    e->mime_type = mime_type;
+    e->encoding = encoding;
+    make_encoded_validators(st, encoding, &e->validators);
+    // ranges are only served on the file as is; coded or not, caches must key on Accept-Encoding
+    e->head_len = snprintf(e->head, sizeof(e->head),
+                           "%s%s%s%s%sETag: %s\r\nLast-Modified: %s\r\nContent-length: %lu\r\nContent-type: %s\r\n\r\n",
+                           e->name[0] && !encoding ? "Accept-Ranges: bytes\r\n" : "",
+                           encoding ? "Content-Encoding: " : "", encoding ? encoding_name(encoding) : "",
+                           encoding ? "\r\n" : "",
+                           e->name[0] && compressible(mime_type) ? "Vary: Accept-Encoding\r\n" : "",
+                           e->validators.etag, e->validators.last_modified, (unsigned long)e->body_len, e->mime_type);
+    if (e->head_len >= sizeof(e->head)){
+        cache_entry_free(e);        // sent uncached, with a head built per response
+        return NULL;
+    }
+    e->charge = charge;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->checked = monotonic_seconds();
+    e->ix = index_lookup(path);
+
+    // a stale copy under the same key goes first
+    bucket = &file_cache.buckets[e->hash & (file_cache.nbuckets - 1)];
+    for (cache_entry *old = *bucket; old; old = old->hnext)
+        if (old->hash == e->hash && old->encoding == encoding && strcmp(old->key, path) == 0){
+            cache_unlink(old);
+            break;
+        }
+    while (file_cache.bytes + charge > config.cache_bytes && file_cache.lru_tail){
+        cache_unlink(file_cache.lru_tail);
+        file_cache.evictions++;
+    }
+
+    e->wd = cache_watch_dir(e);
+    e->hnext = *bucket;
+    *bucket = e;
+    e->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head) file_cache.lru_head->lru_prev = e; else file_cache.lru_tail = e;
+    file_cache.lru_head = e;
+    file_cache.bytes += charge;
+    e->linked = 1;
+    return e;
+}
+
+// read size bytes of fd into a new buffer; NULL if the file shrank or the read failed
+static char *read_file_body(int fd, off_t size){
+    size_t got = 0;
+    ssize_t n;
+    char *body;
+    if ((body = malloc(size ? size : 1)) == NULL)
+        return NULL;
+    while (got < size){
+        if ((n = pread(fd, body + got, size - got, got)) <= 0){
+            if (n < 0 && errno == EINTR)
+                continue;
+            free(body);
+            return NULL;
+        }
+        got += n;
+    }
+    return body;
+}
+
+// load the open regular file fd into the cache under path, as the variant
+// in the given ENC_* coding (a precompressed sibling) or as is for 0.
+// returns NULL if the cache is off or the file is too big for it
+cache_entry *file_cache_insert(const char *path, int fd, struct stat *st, int encoding){
+    char *body;
+    if (file_cache.buckets == NULL || st->st_size > config.cache_max_file)
+        return NULL;
+    if ((body = read_file_body(fd, st->st_size)) == NULL)
+        return NULL;
+    return file_cache_add(path, st, body, st->st_size, get_mime_type((char *)path), encoding);
+}
+
+// drain inotify and drop every entry whose file (or directory) changed
+void file_cache_invalidate(void){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    cache_watch *w;
+    cache_entry *e, *next;
+    ssize_t n;
+    char *p;
+    int i;
+
+    while ((n = read(file_cache.inotify_fd, buf, sizeof(buf))) > 0){
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len){
+            ev = (const struct inotify_event *)p;
+            docroot_index_event(ev);
+            if (ev->mask & IN_Q_OVERFLOW){     // lost events: trust nothing
+                while (file_cache.lru_head)
+                    cache_unlink(file_cache.lru_head);
+                continue;
+            }
+            if ((w = cache_find_watch(ev->wd)) == NULL)
+                continue;
+            for (e = w->entries; e; e = next){
+                next = e->wnext;
+                // ev->len 0: the directory itself changed; a listing (empty
+                // name) is stale after any change to its directory. names are
+                // matched as prefixes so a.js.gz appearing or changing also drops
+                // the variants cached for a.js (and, harmlessly, a.jsx's)
+                if (ev->len == 0 || e->name[0] == '\0' || strncmp(e->name, ev->name, strlen(e->name)) == 0)
+                    cache_unlink(e);
+            }
+            if (ev->mask & IN_IGNORED){
+                i = w - file_cache.watches;
+                file_cache.watches[i] = file_cache.watches[--file_cache.nwatches];
+            }
+        }
+    }
+}
+
+// queue a cached response: the 200 template and Connection (copied into the arena,
+// so a Date refresh can't change bytes mid-send), cached head and body in one writev()
+void serve_cached(http_conn *c, cache_entry *e){
+    e->refs++;
+    c->cached = e;
+    c->status = 200;
+    conn_start_head(c, 200, "OK");
+    c->iov[0].iov_base = c->wbuf;
+    c->iov[0].iov_len = c->wlen;
+    c->iov[1].iov_base = e->head;
+    c->iov[1].iov_len = e->head_len;
+    c->iov[2].iov_base = e->body;
+    c->iov[2].iov_len = e->body_len;
+    c->iovcnt = 3;
+    c->state = CONN_SEND_CACHED;
+}
+
+// write the queued iovecs, resuming across EAGAIN.
+// returns 1 when everything is sent, 0 if the socket is full, -1 on error
+static int send_cached(http_conn *c){
+    struct iovec *iov = c->iov + (3 - c->iovcnt);
+    ssize_t n;
+    while (c->iovcnt > 0){
+        if ((n = writev(c->fd, iov, c->iovcnt)) < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->bytes_sent += n;
+        // skip what went out, fully written iovecs first
+        while (c->iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            c->iovcnt--;
+        }
+        if (c->iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    cache_release(c->cached);
+    c->cached = NULL;
+    return 1;
+}
+
+// per-process cache of open descriptors for large files: hash table + LRU list
+typedef struct {
+    fd_entry **buckets;         // NULL while the cache is disabled
+    size_t nbuckets;            // power of two
+    int count;                  // linked entries
+    fd_entry *lru_head;
+    fd_entry *lru_tail;
+    unsigned long hits, misses, evictions;
+} descriptor_cache;
+
+descriptor_cache fd_cache = { NULL, 0, 0, NULL, NULL, 0, 0, 0 };
+
+void fd_cache_init(void){
+    size_t n = 64;
+    if (config.fd_cache_max <= 0)
+        return;
+    while (n < config.fd_cache_max * 2)
+        n *= 2;
+    if ((fd_cache.buckets = calloc(n, sizeof(fd_entry *))) != NULL)
+        fd_cache.nbuckets = n;
+}
+
+static void fd_entry_free(fd_entry *e){
+    close(e->fd);
+    free(e->key);
+    free(e);
+}
+
+// drop e from the table; the descriptor stays open until the last sender releases it
+static void fd_cache_unlink(fd_entry *e){
+    fd_entry **pp = &fd_cache.buckets[e->hash & (fd_cache.nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else fd_cache.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else fd_cache.lru_tail = e->lru_prev;
+    fd_cache.count--;
+    e->linked = 0;
+    if (e->refs == 0)
+        fd_entry_free(e);
+}
+
+void fd_cache_release(fd_entry *e){
+    if (--e->refs == 0 && !e->linked)
+        fd_entry_free(e);
+}
+
+// find a still-valid descriptor for path and take a reference on it.
+// the held fd already sees in-place writes; a stat() every fd_cache_ttl
+// seconds catches the file being replaced, removed or resized
+fd_entry *fd_cache_lookup(const char *path){
+    fd_entry *e;
+    unsigned h;
+    struct stat st;
+    time_t now;
+    if (fd_cache.buckets == NULL)
+        return NULL;
+    h = hash_path(path);
+    for (e = fd_cache.buckets[h & (fd_cache.nbuckets - 1)]; e; e = e->hnext)
+        if (e->hash == h && strcmp(e->key, path) == 0)
+            break;
+    if (e == NULL){
+        fd_cache.misses++;
+        return NULL;
+    }
+    if ((now = monotonic_seconds()) - e->checked >= config.fd_cache_ttl){
+        if (stat(path, &st) < 0 || st.st_ino != e->st.st_ino || st.st_dev != e->st.st_dev ||
+            st.st_size != e->st.st_size || st.st_mtim.tv_sec != e->st.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec){
+            fd_cache_unlink(e);
+            fd_cache.misses++;
+            return NULL;
+        }
+        e->checked = now;
+    }
+    if (e != fd_cache.lru_head){
+        e->lru_prev->lru_next = e->lru_next;
+        if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else fd_cache.lru_tail = e->lru_prev;
+        e->lru_prev = NULL;
+        e->lru_next = fd_cache.lru_head;
+        fd_cache.lru_head->lru_prev = e;
+        fd_cache.lru_head = e;
+    }
+    fd_cache.hits++;
+    e->refs++;
+    return e;
+}
+
+// adopt the open descriptor fd for path and take a reference on the new entry.
+// returns NULL (fd untouched) if the cache is off or out of memory
+fd_entry *fd_cache_insert(const char *path, int fd, struct stat *st){
+    fd_entry *e, **bucket;
+    if (fd_cache.buckets == NULL || (e = calloc(1, sizeof(fd_entry))) == NULL)
+        return NULL;
+    if ((e->key = strdup(path)) == NULL){
+        free(e);
+        return NULL;
+    }
+    e->hash = hash_path(path);
+    e->fd = fd;
+    e->st = *st;
+    make_validators(st, &e->validators);
+    e->checked = monotonic_seconds();
+    e->ix = index_lookup(path);
+    bucket = &fd_cache.buckets[e->hash & (fd_cache.nbuckets - 1)];
+    for (fd_entry *old = *bucket; old; old = old->hnext)
+        if (old->hash == e->hash && strcmp(old->key, path) == 0){
+            fd_cache_unlink(old);
+            break;
+        }
+    while (fd_cache.count >= config.fd_cache_max && fd_cache.lru_tail){
+        fd_cache_unlink(fd_cache.lru_tail);
+        fd_cache.evictions++;
+    }
+    e->hnext = *bucket;
+    *bucket = e;
+    e->lru_next = fd_cache.lru_head;
+    if (fd_cache.lru_head) fd_cache.lru_head->lru_prev = e; else fd_cache.lru_tail = e;
+    fd_cache.lru_head = e;
+    fd_cache.count++;
+    e->linked = 1;
+    e->refs = 1;
+    return e;
+}
+
+// done with the response body: hand a borrowed descriptor back, close an owned one
+static void conn_release_file(http_conn *c){
+    if (c->file_entry)
+        fd_cache_release(c->file_entry);
+    else if (c->file_fd >= 0)
+        close(c->file_fd);
+    c->file_entry = NULL;
+    c->file_fd = -1;
+}
+
+static void listing_free(http_conn *c){
+    if (c->listing == NULL)
+        return;
+    close(c->listing->fd);
+    free(c->listing->copy);
+    free(c->listing);
+    c->listing = NULL;
+}
+
+// keep a copy of rendered rows for the content cache while the listing stays small enough
+static void listing_keep(dir_listing *l, const char *p, size_t n){
+    char *q;
+    size_t cap;
+    if (l->copy == NULL)
+        return;
+    if (l->copy_len + n > config.cache_bytes / 4){
+        free(l->copy);              // too big to be worth caching
+        l->copy = NULL;
+        return;
+    }
+    if (l->copy_len + n > l->copy_cap){
+        for (cap = l->copy_cap ? l->copy_cap : LISTING_CHUNK; cap < l->copy_len + n; cap *= 2)
+            ;
+        if ((q = realloc(l->copy, cap)) == NULL){
+            free(l->copy);
+            l->copy = NULL;
+            return;
+        }
+        l->copy = q;
+        l->copy_cap = cap;
+    }
+    memcpy(l->copy + l->copy_len, p, n);
+    l->copy_len += n;
+}
+
+static const char listing_header[] = "<html><head><style>body{font-family: monospace; font-size: 13px;}"
+                                     "td {padding: 1.5px 6px;}</style></head><body><table>\n";
+static const char listing_footer[] = "</table>";
+
+// pre-process files in the "home" directory and start streaming the list to the client.
+// takes ownership of dir_fd; rows are rendered a chunk at a time by send_listing()
+void handle_directory_request(http_conn *c, int dir_fd, char *filename, struct stat *st){
+    dir_listing *l;
+    if ((l = malloc(sizeof(dir_listing))) == NULL){
+        close(dir_fd);
+        client_error(c, 500, "Internal Server Error", "Out of memory.");
+        return;
+    }
+    l->fd = dir_fd;
+    l->st = *st;
+    l->pos = l->len = 0;
+    l->done = 0;
+    l->chunked = slice_eq(c->head.version, "HTTP/1.1");
+    l->copy = file_cache.buckets ? malloc(LISTING_CHUNK) : NULL;
+    l->copy_len = 0;
+    l->copy_cap = l->copy ? LISTING_CHUNK : 0;
+    snprintf(l->key, sizeof(l->key), "%s%s", filename,
+             filename[0] && filename[strlen(filename) - 1] == '/' ? "" : "/");
+    c->listing = l;
+    c->status = 200;
+    c->state = CONN_SEND_LISTING;
+    if (!l->chunked)
+        c->req.keep_alive = 0;      // the end of the body is the end of the connection
+    // send response headers to client e.g., "HTTP/1.1 200 OK\r\n"
+    conn_start_head(c, 200, "OK");
+    conn_printf(c, "Content-Type: text/html\r\n%s\r\n", l->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+}
+
+/*
+ *    Render the next chunk of rows into wbuf. Names come from
+ *    getdents64() batches and sizes/dates from fstatat() against the
+ *    directory descriptor, so no entry is ever opened. The chunk-size
+ *    line is written into a gap reserved in front of the rows once their
+ *    length is known. Returns -1 if the directory can't be read.
+ */
+static int render_listing_chunk(http_conn *c){
+    dir_listing *l = c->listing;
+    char curtime[64], sz[64];
+    struct stat statbuf;
+    struct dirent64 *entry;
+    struct tm tm;
+    size_t start;
+    ssize_t n;
+    char hex[16];
+    int h;
+
+    c->wlen = c->woff = 0;
+    if (l->chunked)
+        conn_printf(c, "%10s", "");     // room for "<hex size>\r\n"
+    start = c->wlen;
+    if (l->len == 0)                    // first chunk, nothing read from the directory yet
+        conn_printf(c, "%s", listing_header);
+
+    while (c->wlen - start < LISTING_CHUNK){
+        if (l->pos >= l->len){
+            if ((n = getdents64(l->fd, l->dents, sizeof(l->dents))) < 0){
+                perror ("Open directory failed");
+                return -1;
+            }
+            if (n == 0){
+                l->done = 1;
+                conn_printf(c, "%s", listing_footer);
+                break;
+            }
+            l->len = n;
+            l->pos = 0;
+        }
+        entry = (struct dirent64 *)(l->dents + l->pos);
+        l->pos += entry->d_reclen;
+        if (entry->d_name[0] == '.')        /*skip ".", ".." and hidden files*/
+            continue;
+        if (fstatat(l->fd, entry->d_name, &statbuf, 0) < 0)
+            continue;
+        localtime_r(&statbuf.st_mtime, &tm);
+        strftime(curtime, sizeof(curtime), "%Y-%m-%d %H:%M", &tm);
+        format_size(sz, &statbuf);      /*display size*/
+        conn_printf(c, "<tr><td><a href=\"%s\">%s</a></td><td>%s</td><td>%s</td></tr>", entry->d_name, entry->d_name,curtime, sz);
+    }
+    listing_keep(l, c->wbuf + start, c->wlen - start);
+
+    if (l->chunked){
+        if (c->wlen > start){
+            h = snprintf(hex, sizeof(hex), "%zx\r\n", c->wlen - start);
+            memcpy(c->wbuf + start - h, hex, h);
+            c->woff = start - h;
+            conn_printf(c, "\r\n");
+        } else {
+            c->woff = c->wlen;
+        }
+        if (l->done)
+            conn_printf(c, "0\r\n\r\n");  // last chunk
+    }
+    return 0;
+}
+
+/*
+ *    Blocking-I/O pool. open(), fstat(), getdents64() and fstatat() on a
+ *    cold path, or a cold directory, can stall for as long as the disk or
+ *    the NFS server takes, and every connection of the event loop waits
+ *    with them. With --io-threads, process() hands a content and fd
+ *    cache miss to the pool, and send_listing() hands over each chunk of
+ *    a listing. A pool thread opens and stats the file, reads a body
+ *    the content cache is going to take, or starts readahead on one that
+ *    will be streamed. It then posts the connection back through an
+ *    eventfd, and the loop finishes the request in fs_finish(). The pool
+ *    owns the connection in between: conn_run() leaves CONN_FS_WAIT
+ *    alone and no deadline runs. Each thread has a bounded queue.
+ *    Submissions go round-robin, and an idle thread steals from the
+ *    others, so a thread stuck on one slow mount doesn't strand the
+ *    jobs behind it. When every queue is full the loop does the work
+ *    itself, as it does without a pool.
+ */
+#define FS_QUEUE 256                // jobs queued per pool thread
+#define FS_READAHEAD (2 << 20)      // bytes of a streamed file read ahead before sending starts
+#define MAX_IO_THREADS 64
+
+enum {
+    FS_OPEN,                        // open and fstat a cache miss, reading or prefetching its body
+    FS_WARM,                        // find, open and read the best coding of a compressible file
+    FS_LISTING                      // render the next chunk of a directory listing
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    http_conn *jobs[FS_QUEUE];
+    unsigned head;                  // next job the owner takes
+    unsigned tail;                  // one past the newest, where thieves take from
+} fs_queue;
+
+static struct {
+    int nthreads;                   // 0: no pool, the loop blocks instead
+    fs_queue queues[MAX_IO_THREADS];
+    unsigned next;                  // queue of the next submission
+    sem_t ready;                    // jobs queued and not yet claimed by a thread
+    int efd;                        // eventfd the loop watches for finished jobs
+    pthread_mutex_t done_lock;
+    http_conn *done;                // finished jobs, newest first
+} fs_pool = { .efd = -1 };
+
+// hand c to the pool for kind of work; -1 if there is no pool or no room in it
+static int fs_submit(http_conn *c, int kind){
+    fs_queue *q;
+    int i;
+    for (i = 0; i < fs_pool.nthreads; i++){
+        q = &fs_pool.queues[fs_pool.next++ % fs_pool.nthreads];
+        pthread_mutex_lock(&q->lock);
+        if (q->tail - q->head < FS_QUEUE){
+            c->fs_kind = kind;
+            c->fs_resume = c->state;
+            c->state = CONN_FS_WAIT;
+            q->jobs[q->tail++ % FS_QUEUE] = c;
+            pthread_mutex_unlock(&q->lock);
+            sem_post(&fs_pool.ready);
+            return 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return -1;
+}
+
+// take the oldest job from our own queue or the newest from someone else's
+static http_conn *fs_take(fs_queue *q, int own){
+    http_conn *c = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail)
+        c = own ? q->jobs[q->head++ % FS_QUEUE] : q->jobs[--q->tail % FS_QUEUE];
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+
+static void encoded_fetch(http_conn *c);
+
+// the blocking part of a job, on a pool thread
+static void fs_run(http_conn *c){
+    struct stat *st = &c->fs_st;
+    if (c->fs_kind == FS_LISTING){
+        c->fs_err = render_listing_chunk(c);
+        return;
+    }
+    if (c->fs_kind == FS_WARM){
+        encoded_fetch(c);
+        return;
+    }
+    c->fs_body = NULL;
+    if ((c->fs_fd = open_beneath(c->req.filename, O_RDONLY)) < 0){
+        c->fs_err = errno;
+        return;
+    }
+    c->fs_err = 0;
+    if (fstat(c->fs_fd, st) < 0)
+        memset(st, 0, sizeof(*st));
+    if (!S_ISREG(st->st_mode) || c->req.range.p != NULL)
+        return;
+    if (st->st_size <= config.cache_max_file){
+        if (file_cache.buckets)
+            c->fs_body = read_file_body(c->fs_fd, st->st_size);   // for the content cache
+    } else {
+        posix_fadvise(c->fs_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        readahead(c->fs_fd, 0, FS_READAHEAD);
+    }
+}
+
+static void *fs_worker(void *arg){
+    int self = (int)(intptr_t)arg, i;
+    http_conn *c;
+    while (1){
+        while (sem_wait(&fs_pool.ready) < 0)
+            ;
+        // the claim guarantees a job in some queue; ours first, then steal
+        for (c = NULL, i = 0; c == NULL; i++)
+            c = fs_take(&fs_pool.queues[(self + i) % fs_pool.nthreads], i % fs_pool.nthreads == 0);
+        fs_run(c);
+        pthread_mutex_lock(&fs_pool.done_lock);
+        c->fs_next = fs_pool.done;
+        fs_pool.done = c;
+        pthread_mutex_unlock(&fs_pool.done_lock);
+        eventfd_write(fs_pool.efd, 1);
+    }
+    return NULL;
+}
+
+// start nthreads pool threads; returns the eventfd to watch, -1 if running without a pool
+int fs_pool_init(int nthreads){
+    pthread_t tid;
+    sigset_t all, old;
+    int i;
+    if (nthreads <= 0 || (fs_pool.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    sem_init(&fs_pool.ready, 0, 0);
+    pthread_mutex_init(&fs_pool.done_lock, NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_mutex_init(&fs_pool.queues[i].lock, NULL);
+    // pool threads never take signals; they stay with the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads; i++){
+        if (pthread_create(&tid, NULL, fs_worker, (void *)(intptr_t)i) != 0){
+            perror("Error starting I/O thread");
+            break;
+        }
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ((fs_pool.nthreads = i) == 0){
+        close(fs_pool.efd);
+        fs_pool.efd = -1;
+        return -1;
+    }
+    return fs_pool.efd;
+}
+
+// the connections whose jobs finished since the last call, oldest first
+static http_conn *fs_completions(void){
+    http_conn *c, *next, *list = NULL;
+    eventfd_t n;
+    eventfd_read(fs_pool.efd, &n);
+    pthread_mutex_lock(&fs_pool.done_lock);
+    c = fs_pool.done;
+    fs_pool.done = NULL;
+    pthread_mutex_unlock(&fs_pool.done_lock);
+    for (; c; c = next){
+        next = c->fs_next;
+        c->fs_next = list;
+        list = c;
+    }
+    return list;
+}
+
+// stream the listing chunk by chunk; once complete, cache the rendered page if the
+// directory didn't change meanwhile. returns 1 when sent, 0 if the socket is full, -1 on error
+static int send_listing(http_conn *c){
+    dir_listing *l = c->listing;
+    struct stat st;
+    int rc;
+    while (1){
+        if ((rc = conn_flush(c, 0)) <= 0)
+            return rc;
+        if (l->done)
+            break;
+        if (fs_submit(c, FS_LISTING) == 0)
+            return 0;               // rendered on a pool thread; fs_finish() resumes here
+        if (render_listing_chunk(c) < 0)
+            return -1;
+    }
+    if (l->copy && fstat(l->fd, &st) == 0 && st.st_mtim.tv_sec == l->st.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == l->st.st_mtim.tv_nsec){
+        file_cache_add(l->key, &l->st, l->copy, l->copy_len, "text/html", 0);
+        l->copy = NULL;             // owned by the cache now
+    }
+    listing_free(c);
+    return 1;
+}
+
+// gzip len bytes of src in one shot into a new buffer; NULL on failure
+static char *gzip_body(const char *src, size_t len, size_t *out_len){
+    z_stream z;
+    uLong bound;
+    char *out, *p;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    bound = deflateBound(&z, len);
+    if ((out = malloc(bound)) == NULL){
+        deflateEnd(&z);
+        return NULL;
+    }
+    z.next_in = (Bytef *)src;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = bound;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END){
+        deflateEnd(&z);
+        free(out);
+        return NULL;
+    }
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    return (p = realloc(out, *out_len ? *out_len : 1)) ? p : out;
+}
+
+// answer from a cache entry: 304 if the client's copy is current, else the entry
+static void serve_cache_entry(http_conn *c, cache_entry *e){
+    index_hit(e->ix);
+    if (not_modified(&c->req, &e->validators))
+        queue_not_modified(c, &e->validators);
+    else
+        serve_cached(c, e);
+}
+
+static void process_opened(http_conn *c, int ffd, int err, struct stat *sbuf);
+
+/*
+ *    Content negotiation for compressible files. In order: a coded
+ *    variant already in the content cache; a precompressed sibling on
+ *    disk (a.js.br, a.js.zst, a.js.gz, best first among what the client
+ *    accepts), cached like any small file or sent with sendfile(); else
+ *    gzip the file once and keep the result in the content cache, so
+ *    the same version is never compressed twice. The LRU budget of the
+ *    content cache bounds the variants with everything else. Anything
+ *    past the cache lookups is an FS_WARM job: encoded_fetch() opens,
+ *    reads and gzips what the answer takes, on a pool thread when there
+ *    is one, and encoded_finish() queues the response from it on the loop.
+ */
+
+// a file this size is compressed here for a client that takes gzip
+static int gzip_on_the_fly(http_request *req, off_t size){
+    return (req->accept_encoding & ENC_GZIP) && config.compress_max_file && file_cache.buckets &&
+           size >= COMPRESS_MIN && size <= config.compress_max_file;
+}
+
+// the blocking part: find the sibling to send, or open and read the file
+// itself. touches no cache, so it runs on a pool thread as well as the loop
+static void encoded_fetch(http_conn *c){
+    http_request *req = &c->req;
+    char path[sizeof(req->filename) + 8];
+    cache_entry *plain = c->fs_plain;
+    struct stat st;
+    off_t size;
+    int i, fd, siblings = 0;
+
+    c->fs_fd = -1;
+    c->fs_err = 0;
+    c->fs_body = NULL;
+    c->fs_encoding = 0;
+    c->fs_gzip = 0;
+    c->fs_gz = NULL;
+    c->fs_siblings = 0;
+    // every sibling is looked for, so a file with none can be remembered as such
+    for (i = 0; i < 3; i++){
+        snprintf(path, sizeof(path), "%s%s", req->filename, encoded_siblings[i].ext);
+        if ((fd = open_beneath(path, O_RDONLY)) < 0)
+            continue;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+            close(fd);
+            continue;
+        }
+        siblings |= encoded_siblings[i].encoding;
+        if (!(req->accept_encoding & encoded_siblings[i].encoding)){
+            close(fd);
+            continue;
+        }
+        c->fs_fd = fd;
+        c->fs_st = st;
+        c->fs_encoding = encoded_siblings[i].encoding;
+        if (st.st_size <= config.cache_max_file && file_cache.buckets)
+            c->fs_body = read_file_body(fd, st.st_size);
+        else
+            readahead(fd, 0, FS_READAHEAD);
+        return;
+    }
+    if (plain == NULL){
+        if ((c->fs_fd = open_beneath(req->filename, O_RDONLY)) < 0){
+            c->fs_err = errno;
+            return;
+        }
+        if (fstat(c->fs_fd, &c->fs_st) < 0 || !S_ISREG(c->fs_st.st_mode))
+            return;                 // process_opened() answers it as any other
+    }
+    size = plain ? plain->size : c->fs_st.st_size;
+    c->fs_siblings = siblings | SIBLINGS_SEEN;
+    c->fs_gzip = gzip_on_the_fly(req, size);
+    if (plain == NULL && (c->fs_gzip || (size <= config.cache_max_file && file_cache.buckets)))
+        c->fs_body = read_file_body(c->fs_fd, size);
+    // up to compress_max_file of deflate, kept off the loop along with the reads
+    if (c->fs_gzip && (plain != NULL || c->fs_body != NULL))
+        c->fs_gz = gzip_body(plain ? plain->body : c->fs_body, size, &c->fs_gz_len);
+}
+
+// back on the loop with what encoded_fetch() found: queue the response
+static void encoded_finish(http_conn *c){
+    http_request *req = &c->req;
+    cache_entry *e, *plain = c->fs_plain;
+    struct stat st;
+    char *gz = c->fs_gz;
+    int fd = c->fs_fd;
+
+    c->fs_plain = NULL;
+    c->fs_gz = NULL;
+    if (plain != NULL)
+        plain->siblings = c->fs_siblings;
+    if (c->fs_encoding){
+        // a precompressed sibling
+        e = c->fs_body ? file_cache_add(req->filename, &c->fs_st, c->fs_body, c->fs_st.st_size,
+                                        get_mime_type(req->filename), c->fs_encoding) : NULL;
+        c->fs_body = NULL;
+        if (e != NULL){
+            e->stat_ext = sibling_ext(c->fs_encoding);
+            close(fd);
+            serve_cache_entry(c, e);
+        } else {
+            c->encoding = c->fs_encoding;
+            make_encoded_validators(&c->fs_st, c->encoding, &c->validators);
+            if (not_modified(req, &c->validators)){
+                close(fd);
+                queue_not_modified(c, &c->validators);
+            } else {
+                serve_static(c, fd, req, c->fs_st.st_size);     // owns fd now
+            }
+        }
+    } else if (gz != NULL && plain != NULL && !plain->linked){
+        free(gz);                   // the file changed meanwhile; answered as is below
+        gz = NULL;
+    } else if (gz != NULL){
+        if (plain != NULL){
+            memset(&st, 0, sizeof(st));
+            st.st_dev = plain->dev;
+            st.st_ino = plain->ino;
+            st.st_size = plain->size;
+            st.st_mtim = plain->mtime;
+        } else {
+            st = c->fs_st;
+        }
+        log_debug("compressed %s: %lld -> %zu bytes", req->filename, (long long)st.st_size, c->fs_gz_len);
+        if ((e = file_cache_add(req->filename, &st, gz, c->fs_gz_len,
+                                get_mime_type(req->filename), ENC_GZIP)) != NULL){
+            if (fd >= 0)
+                close(fd);
+            free(c->fs_body);
+            c->fs_body = NULL;
+            serve_cache_entry(c, e);
+        } else {
+            gz = NULL;              // answered as is below
+        }
+    }
+    if (c->fs_encoding == 0 && gz == NULL){
+        // the file as is
+        if (plain != NULL){
+            serve_cache_entry(c, plain);
+        } else {
+            if (c->fs_body && c->fs_st.st_size > config.cache_max_file){
+                free(c->fs_body);   // read to be compressed, too big to cache
+                c->fs_body = NULL;
+            }
+            process_opened(c, fd, c->fs_err, &c->fs_st);
+        }
+    }
+    c->fs_siblings = 0;
+    if (plain != NULL)
+        cache_release(plain);
+}
+
+// nothing to negotiate, going by the codings an earlier request found next to the file
+static int plain_only(http_request *req, int siblings, off_t size){
+    return (siblings & SIBLINGS_SEEN) && !(req->accept_encoding & siblings & ~SIBLINGS_SEEN) &&
+           !gzip_on_the_fly(req, size);
+}
+
+// returns 1 if a response was queued or is being fetched, 0 to send the file as is
+static int serve_encoded(http_conn *c){
+    http_request *req = &c->req;
+    cache_entry *e, *plain;
+    fd_entry *fe;
+    int i, skip;
+
+    for (i = 0; i < 3; i++)
+        if ((req->accept_encoding & encoded_siblings[i].encoding) &&
+            (e = file_cache_lookup_encoded(req->filename, encoded_siblings[i].encoding)) != NULL){
+            serve_cache_entry(c, e);
+            return 1;
+        }
+    // already known not to be worth it: too small, or nothing to negotiate
+    if ((plain = file_cache_lookup(req->filename)) != NULL &&
+        (plain->body_len < COMPRESS_MIN || plain_only(req, plain->siblings, plain->size)))
+        return 0;
+    if ((fe = fd_cache_lookup(req->filename)) != NULL){
+        skip = plain_only(req, fe->siblings, fe->st.st_size);
+        fd_cache_release(fe);
+        if (skip)
+            return 0;
+    }
+    if (req->memo != NULL && req->memo->missing == monotonic_seconds())
+        return 0;                   // process() has the 404 at hand
+    if (plain != NULL)
+        plain->refs++;              // its body outlives an eviction while the job runs
+    c->fs_plain = plain;
+    if (fs_submit(c, FS_WARM) == 0)
+        return 1;
+    encoded_fetch(c);
+    encoded_finish(c);
+    return 1;
+}
+
+static int serve_dynamic(http_conn *c);
+static int dyn_poll(http_conn *c);
+static int ndyn_routes;
+
+// the fd cache takes the descriptor, with the codings a negotiation found next to it
+static fd_entry *conn_fd_cache_insert(http_conn *c, int fd, struct stat *st){
+    fd_entry *fe = fd_cache_insert(c->req.filename, fd, st);
+    if (fe != NULL)
+        fe->siblings = c->fs_siblings;
+    return fe;
+}
+
+// the content cache takes the body a pool thread already read, or reads it itself
+static cache_entry *conn_cache_insert(http_conn *c, int fd, struct stat *st){
+    char *body = c->fs_body;
+    cache_entry *e;
+    if (body == NULL){
+        e = file_cache_insert(c->req.filename, fd, st, 0);
+    } else {
+        c->fs_body = NULL;
+        e = file_cache_add(c->req.filename, st, body, st->st_size, get_mime_type(c->req.filename), 0);
+    }
+    if (e != NULL)
+        e->siblings = c->fs_siblings;
+    return e;
+}
+
+// handle one HTTP request/response transaction: pick the response for the
+// parsed request and queue it on the connection
+void process(http_conn *c){
+    http_request *req = &c->req;
+    int fd = c->fd;
+
+    log_debug("processing request, fd = %d", fd);
+
+    struct stat sbuf;
+    char * msg1 = "We haven't found what you requested.";
+    cache_entry *e;
+    c->status = 200; //server status init as 200
+    c->state = CONN_WRITE_RESPONSE;
+    fd_entry *fe;
+    index_entry *ix;
+    // admin page, local clients only; everyone else sees an ordinary missing file
+    if (strcmp(req->filename, STATS_PATH) == 0 &&
+        c->addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK)){
+        serve_stats(c);
+        return;
+    }
+#ifndef NO_METRICS
+    if (strcmp(req->filename, METRICS_PATH) == 0 &&
+        c->addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK)){
+        serve_metrics(c);
+        return;
+    }
+#endif
+    // a handler prefix: the request, body and all, goes to a dynamic handler
+    if (ndyn_routes && serve_dynamic(c))
+        return;
+    // text types go out compressed when the client takes a coding we have or can make
+    if (req->accept_encoding && req->range.p == NULL && req->filename[strlen(req->filename) - 1] != '/' &&
+        compressible(get_mime_type(req->filename)) && serve_encoded(c))
+        return;
+    // hot file: no open, no fstat; the conditional check uses the entry's validators
+    if ((e = file_cache_lookup(req->filename)) != NULL){
+        index_hit(e->ix);
+        if (not_modified(req, &e->validators)){
+            queue_not_modified(c, &e->validators);
+            return;
+        }
+        // range requests are answered from a descriptor, never from the content cache
+        if (req->range.p == NULL){
+            serve_cached(c, e);
+            return;
+        }
+    }
+    if ((fe = fd_cache_lookup(req->filename)) != NULL){
+        index_hit(fe->ix);
+        // large file we already hold open: no open, no fstat
+        if (not_modified(req, &fe->validators)){
+            fd_cache_release(fe);
+            queue_not_modified(c, &fe->validators);
+            return;
+        }
+        c->file_entry = fe;
+        c->validators = fe->validators;
+        serve_static(c, fe->fd, req, fe->st.st_size);
+        return;
+    }
+    // indexed file: a revalidation is answered without open() or fstat()
+    if ((ix = index_lookup(req->filename)) != NULL){
+        index_hit(ix);
+        if (index_trusted(ix)){
+            index_stat(ix, &sbuf);
+            make_validators(&sbuf, &c->validators);
+            if (not_modified(req, &c->validators)){
+                queue_not_modified(c, &c->validators);
+                return;
+            }
+        }
+    }
+    // a miss confirmed this second: no path walk
+    if (req->memo != NULL && req->memo->missing == monotonic_seconds()){
+        client_error(c, 404, "Not found", msg1);
+        return;
+    }
+    if (fs_submit(c, FS_OPEN) == 0)
+        return;                     // opened on a pool thread, then process_opened()
+    int ffd = open_beneath(req->filename, O_RDONLY);
+    int err = errno;
+    if (ffd >= 0)
+        fstat(ffd, &sbuf);
+    process_opened(c, ffd, err, &sbuf);
+}
+
+// the part of process() after the open: ffd is the requested file with its
+// stat in sbuf, or -1 with err the open's errno
+static void process_opened(http_conn *c, int ffd, int err, struct stat *sbuf){
+    http_request *req = &c->req;
+    char * msg1 = "We haven't found what you requested.";
+    char *msg2 = "Unknown Error occured.";
+    cache_entry *e;
+    fd_entry *fe;
+    log_debug("opened %s for directory or static content", req->filename);
+    
+    if(ffd < 0){
+        if (req->memo != NULL && (err == ENOENT || err == ENOTDIR))
+            req->memo->missing = monotonic_seconds();
+        // detect 404 error and print error log
+        client_error(c, 404, "Not found", msg1);        /*Return format:  HTTP 1.1 404 Not found \n Content-length: %u \r\n\r\n;*/
+        return;
+    }
+    if(S_ISREG(sbuf->st_mode)){
+        make_validators(sbuf, &c->validators);
+        if (not_modified(req, &c->validators)){
+            // still cache the file: revalidation-heavy clients mostly send conditional requests
+            if (req->range.p == NULL && conn_cache_insert(c, ffd, sbuf) != NULL)
+                close(ffd);
+            else if ((fe = conn_fd_cache_insert(c, ffd, sbuf)) != NULL)
+                fd_cache_release(fe);   // the fd cache keeps ffd open
+            else
+                close(ffd);
+            queue_not_modified(c, &c->validators);
+            return;
+        }
+        if (req->range.p == NULL && (e = conn_cache_insert(c, ffd, sbuf)) != NULL){
+            close(ffd);
+            serve_cached(c, e);
+            return;
+        }
+        // keep the descriptor for the next request if the fd cache takes it
+        if ((fe = conn_fd_cache_insert(c, ffd, sbuf)) != NULL)
+            c->file_entry = fe;
+        // server serves static content; serve_static() now owns ffd (or borrows it from fe)
+        log_debug("fetching static %s", req->filename);
+        serve_static(c, ffd, req, sbuf->st_size);
+        return;
+    } else if(S_ISDIR(sbuf->st_mode)){
+        // server handle directory request: a cached page is good while the directory's mtime holds
+        char key[520];
+        snprintf(key, sizeof(key), "%s%s", req->filename,
+                 req->filename[strlen(req->filename) - 1] == '/' ? "" : "/");
+        if ((e = file_cache_lookup(key)) != NULL && e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+            e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec && e->ino == sbuf->st_ino){
+            close(ffd);
+            if (not_modified(req, &e->validators))
+                queue_not_modified(c, &e->validators);
+            else
+                serve_cached(c, e);
+            return;
+        }
+        log_debug("fetching directory %s", req->filename);
+        handle_directory_request(c, ffd, req->filename, sbuf);
+        return;
+    } else {
+        // detect 400 error and print error log
+        client_error(c, 400, "Error", msg2);
+    }
+    close(ffd);
+}
+
+// back on the loop with a finished pool job: take up the request where it
+// left off. returns -1 if the connection can't go on
+static int fs_finish(http_conn *c){
+    c->state = c->fs_resume;
+    switch (c->fs_kind){
+    case FS_OPEN:
+        process_opened(c, c->fs_fd, c->fs_err, &c->fs_st);
+        break;
+    case FS_WARM:
+        encoded_finish(c);
+        break;
+    case FS_LISTING:
+        return c->fs_err;
+    }
+    return 0;
+}
+
+/*
+ *    Admission control. A process serves at most config.max_connections
+ *    connections and config.max_inflight requests at once. Past either
+ *    limit the client gets overload_response, a preformatted 503 costing
+ *    one send(), rather than a place in a queue that only grows. When
+ *    accept() itself runs out of descriptors, the reserve descriptor is
+ *    given up for a moment to shed the connection at the head of the
+ *    backlog the same way, and accepting pauses for a tick.
+ */
+static const char overload_response[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+                                        "Connection: close\r\nContent-length: 0\r\n\r\n";
+static int open_conns;          // connections this process holds
+static int inflight;            // of them, requests being answered
+static int reserve_fd = -1;     // spare descriptor, released to shed on EMFILE
+
+// the default connection limit: whatever RLIMIT_NOFILE leaves after the fd cache and housekeeping
+int default_max_connections(void){
+    struct rlimit rl;
+    long n;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+        return 65536;
+    n = (long)rl.rlim_cur - config.fd_cache_max - 64;
+    return n < 16 ? 16 : n;
+}
+
+static void reserve_fd_open(void){
+    if (reserve_fd < 0 && (reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        perror("Error opening the reserve descriptor");
+}
+
+// answer a connection that won't be served with the preformatted 503, and close it
+static void shed_connection(int fd){
+    send(fd, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    METRIC_ADD(shed, 1);
+}
+
+// accept() hit the descriptor limit: free the reserve and use it to take a batch of
+// connections off the backlog, shedding each, so waiting clients hear back at once
+static void shed_on_emfile(int listenfd){
+    int fd, i;
+    if (reserve_fd < 0)
+        return;
+    close(reserve_fd);
+    reserve_fd = -1;
+    for (i = 0; i < ACCEPT_BATCH && (fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0; i++)
+        shed_connection(fd);
+    reserve_fd_open();
+}
+
+// a request arriving past the in-flight limit: same 503, then the connection closes
+static void shed_request(http_conn *c){
+    c->req.keep_alive = 0;
+    c->status = 503;
+    c->state = CONN_WRITE_RESPONSE;
+    conn_append(c, overload_response, sizeof(overload_response) - 1);
+    METRIC_ADD(shed, 1);
+}
+
+// allocate the state for a freshly accepted connection
+http_conn *conn_new(int fd, struct sockaddr_in *clientaddr){
+    http_conn *c = calloc(1, sizeof(http_conn));
+    if (c == NULL){
+        perror("Error allocating connection");
+        return NULL;
+    }
+    c->fd = fd;
+    c->addr = *clientaddr;
+    c->state = CONN_READ_REQUEST;
+    c->file_fd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->ring_buf = -1;
+    c->wbuf = c->arena;
+    c->wcap = sizeof(c->arena);
+    rio_readinitb(&c->rio, fd);
+    open_conns++;
+    METRIC_ADD(accepted, 1);
+    METRIC_ADD(active, 1);
+    return c;
+}
+
+void conn_close(http_conn *c){
+    conn_release_file(c);
+    if (c->pipefd[0] >= 0){
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    if (c->cached)
+        cache_release(c->cached);
+    listing_free(c);
+    free(c->dyn_msg);
+    if (c->inflight)
+        inflight--;
+    open_conns--;
+    METRIC_ADD(active, -1);
+    close(c->fd);
+    conn_arena_reset(c);
+    free(c);
+}
+
+// drive one connection as far as it goes without blocking.
+// returns 0 while waiting on the socket, -1 once the connection should be closed
+int conn_run(http_conn *c){
+    int rc;
+    while (1){
+        switch (c->state){
+        case CONN_READ_REQUEST: {
+            METRIC_START(t_parse);
+            if ((rc = parse_request(c)) <= 0)
+                return rc;
+            METRIC_PHASE(PHASE_PARSE, t_parse);
+            if (c->state == CONN_READ_REQUEST){  // not already answered with an error
+                METRIC_START(t_open);
+                if (config.max_inflight && inflight >= config.max_inflight){
+                    shed_request(c);
+                } else {
+                    c->inflight = 1;
+                    inflight++;
+                    process(c);
+                }
+                METRIC_PHASE(PHASE_OPEN, t_open);
+            }
+            break;
+        }
+        case CONN_WRITE_RESPONSE: {
+            // error pages, 304s, redirects: the whole response is one head write
+            METRIC_START(t_head);
+            rc = conn_flush(c, 0);
+            METRIC_ACCUM(c, PHASE_HEADER, t_head);
+            if (rc <= 0)
+                return rc ? -1 : 0;
+            c->state = CONN_DONE;
+            break;
+        }
+        case CONN_SEND_FILE:
+            if ((rc = serve_static(c, c->file_fd, &c->req, c->file_size)) <= 0)
+                return rc ? -1 : 0;
+            c->state = CONN_DONE;
+            break;
+        case CONN_SEND_CACHED: {
+            // head and body leave in one writev(), all counted as body
+            METRIC_START(t_body);
+            rc = send_cached(c);
+            METRIC_ACCUM(c, PHASE_BODY, t_body);
+            if (rc <= 0)
+                return rc ? -1 : 0;
+            c->state = CONN_DONE;
+            break;
+        }
+        case CONN_SEND_LISTING: {
+            METRIC_START(t_body);
+            rc = send_listing(c);
+            METRIC_ACCUM(c, PHASE_BODY, t_body);
+            if (rc <= 0)
+                return rc ? -1 : 0;
+            c->state = CONN_DONE;
+            break;
+        }
+        case CONN_FS_WAIT:
+            return 0;               // the pool has it; fs_finish() picks up
+        case CONN_DYNAMIC:
+            if ((rc = dyn_poll(c)) <= 0)
+                return rc;          // a handler worker has it until its END record
+            break;
+        case CONN_DONE:
+            // print log/status on the terminal
+            log_access(c->status, &c->addr, &c->req, c->bytes_sent,
+                       (long)((monotonic_ns() - c->req_start) / 1000));
+            stats_record(&c->addr, c->req.browser_index);
+            METRIC_REQUEST_DONE(c);
+            c->req_start = 0;
+            c->bytes_sent = 0;
+            if (c->inflight){
+                c->inflight = 0;
+                inflight--;
+            }
+            if (!c->req.keep_alive || ++c->requests >= config.max_requests)
+                return -1;
+            // get ready for the next request; pipelined bytes already in rio are parsed first
+            conn_release_file(c);
+            conn_arena_reset(c);
+            c->use_splice = 0;
+            c->encoding = 0;
+            c->nranges = 0;
+            c->status = 0;
+            c->state = CONN_READ_REQUEST;
+            http_head_reset(&c->head);
+            break;
+        }
+    }
+}
+
+// fork mode: the child owns a blocking socket, so conn_run() only stops on
+// EAGAIN when SO_RCVTIMEO expires on an idle connection or SO_SNDTIMEO on a
+// client that stopped reading; parse_request() enforces the header deadline
+void handle_connection(int fd, struct sockaddr_in *clientaddr){
+    http_conn *c;
+    struct timeval tv = { config.keepalive_timeout, 0 };
+    struct timeval send_tv = { config.send_timeout, 0 };
+    log_debug("accept request, fd is %d", fd);
+    if ((c = conn_new(fd, clientaddr)) == NULL){
+        close(fd);
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_tv, sizeof(send_tv));
+    conn_run(c);
+    conn_close(c);
+}
+
+// reap every finished child so forked connections don't linger as zombies
+volatile sig_atomic_t live_children = 0;   // forked connections still running
+
+void handle_sigchld(int sig){
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        live_children--;
+    errno = saved_errno;
+}
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ *    Hierarchical timing wheel holding every event-loop connection's
+ *    deadline. Level 0 has a slot per TW_TICK_MS tick and each level
+ *    above spans TW_SLOTS slots of the one below. A timer is linked into
+ *    the lowest level its distance fits, so arming and cancelling are
+ *    O(1) list operations; whenever a level wraps, the current slot of
+ *    the level above is cascaded down. Deadlines past the top level are
+ *    clamped to its reach.
+ */
+#define TW_TICK_MS 100
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4                 // 100ms ticks: 6.4s, 6.8min, 7.3h, 19 days
+#define TW_RANGE ((uint64_t)1 << (TW_BITS * TW_LEVELS))
+
+typedef struct {
+    http_conn *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t now;                   // last tick processed
+    int count;                      // armed timers
+} timer_wheel;
+
+static timer_wheel wheel;
+
+static uint64_t wheel_ticks(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TW_TICK_MS;
+}
+
+static void timer_cancel(http_conn *c){
+    if (c->expires == 0)
+        return;
+    if (c->prev) c->prev->next = c->next; else *c->slot = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+    c->expires = 0;
+    wheel.count--;
+}
+
+// arm c's timer for tick expires, replacing any deadline it had
+static void timer_set(http_conn *c, uint64_t expires){
+    uint64_t delta;
+    int level;
+    http_conn **slot;
+    timer_cancel(c);
+    if (expires <= wheel.now)
+        expires = wheel.now + 1;
+    if ((delta = expires - wheel.now) >= TW_RANGE)
+        expires = wheel.now + (delta = TW_RANGE - 1);
+    for (level = 0; level < TW_LEVELS - 1 && delta >= (uint64_t)1 << (TW_BITS * (level + 1)); level++)
+        ;
+    slot = &wheel.slots[level][(expires >> (TW_BITS * level)) & (TW_SLOTS - 1)];
+    c->prev = NULL;
+    if ((c->next = *slot) != NULL)
+        c->next->prev = c;
+    *slot = c;
+    c->slot = slot;
+    c->expires = expires;
+    wheel.count++;
+}
+
+/*
+ *    Advance the wheel to tick now and return the connections whose
+ *    deadline passed, chained through next. Higher levels are cascaded
+ *    top down before level 0 is emptied; a timer due on the very tick
+ *    its slot cascades goes straight to the expired chain.
+ */
+static http_conn *wheel_advance(uint64_t now){
+    http_conn *expired = NULL, *c, *next;
+    uint64_t expires;
+    int level;
+    while (wheel.now < now){
+        wheel.now++;
+        for (level = TW_LEVELS - 1; level > 0; level--){
+            if (wheel.now & (((uint64_t)1 << (TW_BITS * level)) - 1))
+                continue;
+            c = wheel.slots[level][(wheel.now >> (TW_BITS * level)) & (TW_SLOTS - 1)];
+            wheel.slots[level][(wheel.now >> (TW_BITS * level)) & (TW_SLOTS - 1)] = NULL;
+            for (; c; c = next){
+                next = c->next;
+                expires = c->expires;
+                c->expires = 0;     // already off the slot, only to be relinked lower
+                wheel.count--;
+                if (expires <= wheel.now){
+                    c->next = expired;  // due on this very tick
+                    expired = c;
+                } else {
+                    timer_set(c, expires);
+                }
+            }
+        }
+        for (c = wheel.slots[0][wheel.now & (TW_SLOTS - 1)]; c; c = next){
+            next = c->next;
+            c->expires = 0;
+            c->next = expired;
+            expired = c;
+            wheel.count--;
+        }
+        wheel.slots[0][wheel.now & (TW_SLOTS - 1)] = NULL;
+    }
+    return expired;
+}
+
+/*
+ *    Arm the deadline for whatever c is now waiting on. A request head
+ *    must be complete header_timeout after its first byte, however it
+ *    trickles in; a fresh connection gets as long to start one. Between
+ *    keep-alive requests the limit is keepalive_timeout of idleness, and
+ *    a response in flight must see the client read within send_timeout.
+ */
+static void conn_arm_timer(http_conn *c, uint64_t now){
+    uint64_t deadline;
+    if (c->state == CONN_FS_WAIT || c->state == CONN_DYNAMIC){
+        timer_cancel(c);            // can't close it under a pool thread or a handler worker; rearmed once it's back
+        return;
+    }
+    if (c->state != CONN_READ_REQUEST)
+        deadline = now + (uint64_t)config.send_timeout * 1000 / TW_TICK_MS;
+    else if (c->req_start)
+        deadline = ((uint64_t)c->req_start / 1000000 + (uint64_t)config.header_timeout * 1000) / TW_TICK_MS;
+    else if (c->requests == 0 && c->expires)
+        return;                     // still counting from the accept
+    else if (c->requests == 0)
+        deadline = now + (uint64_t)config.header_timeout * 1000 / TW_TICK_MS;
+    else
+        deadline = now + (uint64_t)config.keepalive_timeout * 1000 / TW_TICK_MS;
+    if (deadline != c->expires)
+        timer_set(c, deadline);
+}
+
+static void uring_retire(http_conn *c);
+
+// close everything whose deadline passed, as one batch once the wheel has advanced
+static void expire_connections(void){
+    http_conn *c, *next;
+    int n = 0;
+    for (c = wheel_advance(wheel_ticks()); c; c = next){
+        next = c->next;
+        if (config.mode == MODE_URING)
+            uring_retire(c);        // may have to wait for its ring operation first
+        else
+            conn_close(c);          // close() also drops it from the epoll set
+        n++;
+    }
+    if (n){
+        METRIC_ADD(timeouts, n);
+        log_debug("closed %d connections past their deadline", n);
+    }
+}
+
+// is this accept() error a shortage of descriptors or memory, rather than one bad connection?
+static int accept_exhausted(int err){
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+// accept a batch of pending connections and register them with the event loop;
+// ones past the connection limit are shed. returns -1 if accepting should pause
+static int accept_connections(int epfd, int listenfd){
+    struct sockaddr_in clientaddr;
+    socklen_t clilent_size;
+    struct epoll_event ev;
+    http_conn *c;
+    int connfd, i;
+    for (i = 0; i < ACCEPT_BATCH; i++){
+        clilent_size = sizeof(struct sockaddr_in);
+        METRIC_START(t_accept);
+        connfd = accept4(listenfd, (SA *)&clientaddr, &clilent_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (accept_exhausted(errno)){
+                log_warn("accept: %s, shedding and pausing accepts", strerror(errno));
+                shed_on_emfile(listenfd);
+                return -1;
+            }
+            log_error("accept: %s", strerror(errno));
+            return 0;
+        }
+        METRIC_PHASE(PHASE_ACCEPT, t_accept);
+        if (open_conns >= config.max_connections){
+            shed_connection(connfd);
+            continue;
+        }
+        if ((c = conn_new(connfd, &clientaddr)) == NULL){
+            close(connfd);
+            continue;
+        }
+        // edge-triggered: registering reports the current readiness, so the
+        // first request bytes are picked up on the next epoll_wait()
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0){
+            perror("Error on epoll_ctl");
+            conn_close(c);
+            continue;
+        }
+        conn_arm_timer(c, wheel.now);
+    }
+    return 0;
+}
+
+// run every connection back from the pool on from where its job left it
+static void resume_pool_jobs(uint64_t now){
+    http_conn *c, *next;
+    for (c = fs_completions(); c; c = next){
+        next = c->fs_next;
+        if (fs_finish(c) < 0 || conn_run(c) < 0)
+            conn_close(c);          // no timer while it was in the pool
+        else
+            conn_arm_timer(c, now);
+    }
+}
+
+/*
+ *    Dynamic handlers (--handler=PREFIX=NAME). A request whose path
+ *    starts with a handler's prefix is answered by a C function from
+ *    dyn_handlers[], run in a handler worker. Handler workers are
+ *    persistent processes forked by the serving process. Each one talks
+ *    to it over its own Unix socketpair, with FastCGI-like records: a
+ *    BEGIN record carries the client socket (SCM_RIGHTS), a PARAMS
+ *    record the CGI-style variables, and a STDIN record the body bytes
+ *    the loop had already read. The worker then streams the rest of the
+ *    body from the client as the handler reads it, and streams the
+ *    response to the client, chunked, as the handler writes it. An END
+ *    record hands the connection back. The loop owns no bytes of the
+ *    exchange in between: conn_run() leaves CONN_DYNAMIC alone until END
+ *    arrives, and no deadline runs; the worker times out its own reads
+ *    and writes. Requests wait in a FIFO for an idle worker. While some
+ *    are waiting and every worker is busy, another worker is forked for
+ *    each, up to --handler-workers; workers idle for DYN_IDLE_SECONDS are
+ *    retired down to one. The workers are forked by a spawner process,
+ *    itself forked in dyn_pool_init() while the server has no other
+ *    thread, so no child ever copies a lock some pool or log thread held.
+ *    Fork mode runs the handler in the connection's own child instead.
+ */
+#define MAX_ROUTES 16
+#define MAX_HANDLER_WORKERS 256
+#define DYN_VERSION 1
+#define DYN_PARAMS_MAX 16384        // CGI-style variables of one request
+#define DYN_OUT_BUF 16384           // response bytes batched into one chunk
+#define DYN_DRAIN_MAX (1 << 20)     // unread body bytes skipped to keep the connection; past that it's closed
+#define DYN_IDLE_SECONDS 10
+#define DYN_CHANNEL_FD 3            // where a worker keeps its end of the socketpair
+
+enum { DYN_BEGIN = 1, DYN_PARAMS, DYN_STDIN, DYN_END };
+
+// one record on a worker's socket; length bytes of content follow
+typedef struct {
+    uint8_t version;                // DYN_VERSION
+    uint8_t type;                   // DYN_*
+    uint16_t length;
+} dyn_record;
+
+// DYN_BEGIN content, sent with the client socket
+typedef struct {
+    int32_t handler;                // index into dyn_handlers
+    int32_t keep_alive;             // the response may leave the connection open
+    int64_t content_length;         // request body bytes, the STDIN record's included
+} dyn_begin;
+
+// DYN_END content
+typedef struct {
+    int32_t status;
+    int32_t keep_alive;             // the connection is at the start of its next request
+    int64_t bytes_sent;
+} dyn_end;
+
+// a request being answered by a handler, in a handler worker
+typedef struct {
+    int fd;                         // the client connection
+    const char *params;             // "NAME\0value\0" pairs
+    size_t params_len;
+    const char *prefix;             // body bytes the server had already read
+    size_t prefix_len;
+    long long body_left;            // body bytes not yet read by the handler, prefix included
+    int expect_continue;            // the client waits for "100 Continue" before sending the body
+    int keep_alive;
+    int chunked;                    // chunked framing; HTTP/1.0 gets a close-delimited body
+    int started;                    // the head is written
+    int failed;                     // the client went away or timed out
+    int status;
+    long long bytes_sent;
+    char head[512];                 // response head not yet sent
+    size_t head_len;
+    char out[DYN_OUT_BUF];          // body bytes not yet sent
+    size_t out_len;
+} dyn_ctx;
+
+// the value of a CGI-style variable of the request, "" if it has none
+const char *dyn_param(dyn_ctx *x, const char *name){
+    const char *p = x->params, *end = x->params + x->params_len;
+    while (p < end){
+        const char *value = p + strlen(p) + 1;
+        if (value >= end)
+            break;
+        if (strcmp(p, name) == 0)
+            return value;
+        p = value + strlen(value) + 1;
+    }
+    return "";
+}
+
+// wait for fd to become ready for events; -1 after seconds without
+static int dyn_wait(int fd, short events, int seconds){
+    struct pollfd pfd = { fd, events, 0 };
+    int n;
+    while ((n = poll(&pfd, 1, seconds * 1000)) < 0 && errno == EINTR)
+        ;
+    return n > 0 ? 0 : -1;
+}
+
+// send all of iov to the client; the socket is the loop's, non-blocking
+static int dyn_sendv(dyn_ctx *x, struct iovec *iov, int iovcnt){
+    struct msghdr msg = { 0 };
+    ssize_t n;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0 && !x->failed){
+        if ((n = sendmsg(x->fd, &msg, MSG_NOSIGNAL)) < 0){
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                                   dyn_wait(x->fd, POLLOUT, config.send_timeout) == 0))
+                continue;
+            x->failed = 1;
+            break;
+        }
+        x->bytes_sent += n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len){
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0){
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return x->failed ? -1 : 0;
+}
+
+// send the head if it's pending and the batched body as one chunk; last ends the body
+static int dyn_flush(dyn_ctx *x, int last){
+    struct iovec iov[5];
+    char size[24];
+    int n = 0;
+    if (x->head_len)
+        iov[n++] = (struct iovec){ x->head, x->head_len };
+    if (x->out_len && x->chunked)
+        iov[n++] = (struct iovec){ size, snprintf(size, sizeof(size), "%zx\r\n", x->out_len) };
+    if (x->out_len)
+        iov[n++] = (struct iovec){ x->out, x->out_len };
+    if (x->out_len && x->chunked)
+        iov[n++] = (struct iovec){ "\r\n", 2 };
+    if (last && x->chunked)
+        iov[n++] = (struct iovec){ "0\r\n\r\n", 5 };    // last chunk
+    x->head_len = x->out_len = 0;
+    return n ? dyn_sendv(x, iov, n) : 0;
+}
+
+// begin the response; a handler that writes without calling this answers 200 text/plain
+int dyn_start(dyn_ctx *x, int status, const char *reason, const char *content_type){
+    time_t now;
+    if (x->started)
+        return -1;
+    x->started = 1;
+    x->status = status;
+    x->chunked = strcmp(dyn_param(x, "SERVER_PROTOCOL"), "HTTP/1.1") == 0;
+    if (!x->chunked)
+        x->keep_alive = 0;
+    x->head_len = snprintf(x->head, sizeof(x->head),
+                           "HTTP/1.1 %d %s\r\nDate: %s\r\nConnection: %s\r\nContent-type: %s\r\n%s\r\n",
+                           status, reason, http_date_now(&now), x->keep_alive ? "keep-alive" : "close",
+                           content_type, x->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+    if (x->head_len >= sizeof(x->head))
+        x->head_len = sizeof(x->head) - 1;
+    return 0;
+}
+
+// queue response body bytes, sending a chunk whenever the batch fills; -1 once the client is gone
+int dyn_write(dyn_ctx *x, const void *buf, size_t len){
+    const char *p = buf;
+    size_t n;
+    if (!x->started)
+        dyn_start(x, 200, "OK", "text/plain");
+    while (len > 0 && !x->failed){
+        if (x->out_len == sizeof(x->out) && dyn_flush(x, 0) < 0)
+            break;
+        n = sizeof(x->out) - x->out_len;
+        if (n > len)
+            n = len;
+        memcpy(x->out + x->out_len, p, n);
+        x->out_len += n;
+        p += n;
+        len -= n;
+    }
+    return x->failed ? -1 : 0;
+}
+
+int dyn_printf(dyn_ctx *x, const char *fmt, ...){
+    char buf[1024];
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    return dyn_write(x, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// read request body bytes as they arrive; 0 at its end, -1 if the client went away
+ssize_t dyn_read(dyn_ctx *x, void *buf, size_t len){
+    ssize_t n;
+    if (x->failed)
+        return -1;
+    if (x->body_left == 0)
+        return 0;
+    if ((long long)len > x->body_left)
+        len = x->body_left;
+    if (x->prefix_len){
+        n = len < x->prefix_len ? len : x->prefix_len;
+        memcpy(buf, x->prefix, n);
+        x->prefix += n;
+        x->prefix_len -= n;
+        x->body_left -= n;
+        return n;
+    }
+    if (x->expect_continue){
+        struct iovec iov = { "HTTP/1.1 100 Continue\r\n\r\n", 25 };
+        x->expect_continue = 0;
+        if (dyn_sendv(x, &iov, 1) < 0)
+            return -1;
+    }
+    while ((n = recv(x->fd, buf, len, 0)) < 0){
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+        // the client waits for what it already sent to be answered, so don't sit on it
+        if (x->head_len || x->out_len){
+            if (dyn_flush(x, 0) < 0)
+                return -1;
+        } else if (dyn_wait(x->fd, POLLIN, config.header_timeout) < 0){
+            break;
+        }
     }
-    
-    while (!feof(fin)) {
-        fgets(buff, MAXLINE, fin);
-        if (num == 0) {
-            strcpy(tmp[num], data);
-            tmp[num][strlen(data)] = '\n';
-            tmp[num][strlen(data)+1] = '\0';
+    if (n <= 0){
+        x->failed = 1;              // body cut short
+        return -1;
+    }
+    x->body_left -= n;
+    return n;
+}
+
+// echo: the request as a handler sees it, then its body streamed back as it arrives
+static void handler_echo(dyn_ctx *x){
+    const char *p, *end = x->params + x->params_len;
+    char buf[8192];
+    ssize_t n;
+    dyn_start(x, 200, "OK", "text/plain");
+    for (p = x->params; p < end; p += strlen(p) + 1){
+        dyn_printf(x, "%s=", p);
+        p += strlen(p) + 1;
+        dyn_printf(x, "%s\n", p);
+    }
+    dyn_write(x, "\n", 1);
+    while ((n = dyn_read(x, buf, sizeof(buf))) > 0)
+        if (dyn_write(x, buf, n) < 0)
+            break;
+}
+
+// lines: ?n=N numbered lines, a body generated while it's sent
+static void handler_lines(dyn_ctx *x){
+    const char *q = dyn_param(x, "QUERY_STRING");
+    long i, n = 10;
+    if (strncmp(q, "n=", 2) == 0)
+        n = atol(q + 2);
+    if (n < 0 || n > 100000000){
+        dyn_start(x, 400, "Bad Request", "text/plain");
+        dyn_printf(x, "n must be 0 .. 100000000\n");
+        return;
+    }
+    dyn_start(x, 200, "OK", "text/plain");
+    for (i = 1; i <= n; i++)
+        if (dyn_printf(x, "line %ld\n", i) < 0)
+            break;
+}
+
+typedef struct {
+    const char *name;               // as given to --handler=PREFIX=NAME
+    void (*fn)(dyn_ctx *x);
+} dyn_handler;
+
+static const dyn_handler dyn_handlers[] = {
+    { "echo", handler_echo },
+    { "lines", handler_lines },
+};
+
+typedef struct {
+    const char *prefix;             // URL path prefix, e.g. "/app/"
+    size_t len;
+    int handler;                    // index into dyn_handlers
+} dyn_route;
+
+static dyn_route dyn_routes[MAX_ROUTES];
+
+// add "PREFIX=NAME" from the command line; -1 if it names no handler
+int dyn_add_route(const char *spec){
+    const char *eq = strchr(spec, '=');
+    size_t i;
+    if (eq == NULL || spec[0] != '/' || ndyn_routes == MAX_ROUTES)
+        return -1;
+    for (i = 0; i < sizeof(dyn_handlers) / sizeof(dyn_handlers[0]); i++){
+        if (strcmp(eq + 1, dyn_handlers[i].name) != 0)
+            continue;
+        dyn_routes[ndyn_routes].prefix = strndup(spec, eq - spec);
+        dyn_routes[ndyn_routes].len = eq - spec;
+        dyn_routes[ndyn_routes++].handler = i;
+        return 0;
+    }
+    return -1;
+}
+
+// answer one request whose BEGIN, PARAMS and STDIN records are in msg, on
+// the client socket fd; fills in the END record's content
+static void dyn_serve(int fd, const char *msg, size_t len, dyn_end *end){
+    const char *p = msg, *content[DYN_END + 1] = { NULL };
+    size_t lens[DYN_END + 1] = { 0 };
+    dyn_begin begin;
+    dyn_record r;
+    dyn_ctx x;
+    while (p + sizeof(r) <= msg + len){
+        memcpy(&r, p, sizeof(r));
+        if (r.type < DYN_END){
+            content[r.type] = p + sizeof(r);
+            lens[r.type] = r.length;
         }
-        num++;
-        strcpy(tmp[num], buff);
-        memset(buff, 0, strlen(buff));
+        p += sizeof(r) + r.length;
     }
-    
-    rewind(fin);
-    for (int i = 0; i <= num; i++) {
-        fputs(tmp[i], fin);
-    }
-    fclose(fin);
-    if (num == 10) {
-        int num1 = 0;
-        memset(buff, 0, strlen(buff));
-        char tmp2[20][MAXLINE];
-        fin = fopen(filename, "r+");
-        if (fin == NULL) {
-            perror("Cannot open the file");
+    memset(end, 0, sizeof(*end));
+    if (content[DYN_BEGIN] == NULL || lens[DYN_BEGIN] != sizeof(begin))
+        return;                     // nothing sent, keep_alive 0: the connection is closed
+    memcpy(&begin, content[DYN_BEGIN], sizeof(begin));
+    if (begin.handler < 0 || begin.handler >= (int)(sizeof(dyn_handlers) / sizeof(dyn_handlers[0])))
+        return;
+    memset(&x, 0, offsetof(dyn_ctx, head));    // not the buffers
+    x.head_len = x.out_len = 0;
+    x.fd = fd;
+    x.params = content[DYN_PARAMS] ? content[DYN_PARAMS] : "";
+    x.params_len = lens[DYN_PARAMS];
+    x.prefix = content[DYN_STDIN];
+    x.prefix_len = lens[DYN_STDIN];
+    x.body_left = begin.content_length;
+    x.keep_alive = begin.keep_alive;
+    x.expect_continue = x.prefix_len == 0 && x.body_left > 0 &&
+                        strcasecmp(dyn_param(&x, "HTTP_EXPECT"), "100-continue") == 0;
+    dyn_handlers[begin.handler].fn(&x);
+    if (!x.started){
+        dyn_start(&x, 500, "Internal Server Error", "text/plain");
+        dyn_printf(&x, "The handler sent no response.\n");
+    }
+    dyn_flush(&x, 1);
+    // skip what the handler didn't read, so the next request can be found
+    if (x.body_left > 0 && (x.expect_continue || x.body_left > DYN_DRAIN_MAX))
+        x.keep_alive = 0;           // cheaper to close than to take a body nobody wants
+    while (x.keep_alive && !x.failed && x.body_left > 0)
+        if (dyn_read(&x, x.out, sizeof(x.out)) < 0)
+            break;
+    end->status = x.status;
+    end->keep_alive = x.keep_alive && !x.failed;
+    end->bytes_sent = x.bytes_sent;
+}
+
+// read exactly len bytes from the server, the first of them with the client socket
+static int dyn_read_full(int chan, char *buf, size_t len, int *client){
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    ssize_t n;
+    while (len > 0){
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = client ? control : NULL;
+        msg.msg_controllen = client ? sizeof(control) : 0;
+        if ((n = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (client && (cm = CMSG_FIRSTHDR(&msg)) != NULL && cm->cmsg_type == SCM_RIGHTS){
+            memcpy(client, CMSG_DATA(cm), sizeof(int));
+            client = NULL;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// a handler worker: answer one request at a time until the server closes its end
+static void dyn_worker_main(int chan){
+    static char msg[3 * sizeof(dyn_record) + sizeof(dyn_begin) + 2 * 65535];
+    char reply[sizeof(dyn_record) + sizeof(dyn_end)];
+    dyn_record r = { DYN_VERSION, DYN_END, sizeof(dyn_end) };
+    dyn_end end;
+    size_t len;
+    int i, client;
+    while (1){
+        client = -1;
+        len = 0;
+        // BEGIN, PARAMS, STDIN
+        for (i = 0; i < 3; i++){
+            if (dyn_read_full(chan, msg + len, sizeof(r), i == 0 ? &client : NULL) < 0)
+                _exit(0);
+            memcpy(&r, msg + len, sizeof(r));
+            len += sizeof(r);
+            if (r.version != DYN_VERSION || dyn_read_full(chan, msg + len, r.length, NULL) < 0)
+                _exit(1);
+            len += r.length;
+        }
+        if (client < 0)
+            _exit(1);
+        dyn_serve(client, msg, len, &end);
+        close(client);
+        log_flush();
+        r = (dyn_record){ DYN_VERSION, DYN_END, sizeof(dyn_end) };
+        memcpy(reply, &r, sizeof(r));
+        memcpy(reply + sizeof(r), &end, sizeof(end));
+        if (write(chan, reply, sizeof(reply)) != sizeof(reply))
+            _exit(1);
+    }
+}
+
+typedef struct dyn_worker {
+    pid_t pid;
+    int fd;                         // our end of its socketpair, -1 for a free slot
+    http_conn *conn;                // request it is answering, NULL while idle
+    time_t idle_since;
+    char end[sizeof(dyn_record) + sizeof(dyn_end)];     // END record read so far
+    size_t end_len;
+} dyn_worker;
+
+static struct {
+    dyn_worker workers[MAX_HANDLER_WORKERS];
+    int nworkers;                   // live workers, busy or idle
+    http_conn *head;                // requests waiting for a worker, oldest first
+    http_conn *tail;
+    int epfd;                       // epoll set a busy worker's socket is in, -1 in uring mode
+    time_t trimmed;                 // last look for idle workers to retire
+    int spawner;                    // socket to the process forking workers, -1 if it failed
+} dyn_pool;
+
+// in a new child: keep fd as DYN_CHANNEL_FD and nothing else of the parent's.
+// a client socket held here would never see its close
+static void dyn_keep_channel(int fd){
+    prctl(PR_SET_PDEATHSIG, SIGTERM);   // don't outlive the parent
+    if (dup2(fd, DYN_CHANNEL_FD) < 0)
+        _exit(1);
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, DYN_CHANNEL_FD + 1, ~0U, 0) < 0)
+#endif
+    {
+        struct rlimit rl;
+        unsigned i;
+        getrlimit(RLIMIT_NOFILE, &rl);
+        for (i = DYN_CHANNEL_FD + 1; i < rl.rlim_cur; i++)
+            close(i);
+    }
+}
+
+// the spawner: for each worker socket the server sends, fork a worker on
+// it and answer with its pid, 0 if the fork failed
+static void dyn_spawner_main(int chan){
+    pid_t pid;
+    char byte;
+    int fd;
+    while (1){
+        fd = -1;
+        if (dyn_read_full(chan, &byte, 1, &fd) < 0)
+            _exit(0);               // the server is gone
+        if (fd < 0)
+            _exit(1);
+        if ((pid = fork()) == 0){
+            dyn_keep_channel(fd);
+            dyn_worker_main(DYN_CHANNEL_FD);
+        }
+        close(fd);
+        if (pid < 0)
+            pid = 0;
+        if (written(chan, &pid, sizeof(pid)) < 0)
+            _exit(1);
+    }
+}
+
+// have the spawner fork one more handler worker; NULL if the pool is full or that failed
+static dyn_worker *dyn_spawn(void){
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    dyn_worker *w;
+    int sv[2];
+    pid_t pid = 0;
+    for (w = dyn_pool.workers; w < dyn_pool.workers + config.handler_workers && w->fd >= 0; w++)
+        ;
+    if (w == dyn_pool.workers + config.handler_workers || dyn_pool.spawner < 0)
+        return NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0){
+        perror("Error creating handler socket");
+        return NULL;
+    }
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &sv[1], sizeof(int));
+    // the spawner is small and single-threaded; its answer takes one fork()
+    if (sendmsg(dyn_pool.spawner, &msg, MSG_NOSIGNAL) != 1 ||
+        dyn_read_full(dyn_pool.spawner, (char *)&pid, sizeof(pid), NULL) < 0 || pid == 0){
+        log_error("could not start a handler worker");
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+    close(sv[1]);
+    set_nonblocking(sv[0]);
+    w->pid = pid;
+    w->fd = sv[0];
+    w->conn = NULL;
+    w->end_len = 0;
+    w->idle_since = time(NULL);
+    dyn_pool.nworkers++;
+    log_debug("handler worker %d started, %d running", pid, dyn_pool.nworkers);
+    return w;
+}
+
+// drop a worker; it exits once it reads the end of its socket
+static void dyn_retire(dyn_worker *w){
+    close(w->fd);                   // also drops it from the epoll set
+    w->fd = -1;
+    w->conn = NULL;
+    dyn_pool.nworkers--;
+}
+
+// start the pool of this serving process; epfd is its epoll set, -1 in uring mode
+static void dyn_pool_init(int epfd){
+    int i, sv[2];
+    pid_t pid;
+    if (ndyn_routes == 0)
+        return;
+    signal(SIGCHLD, SIG_IGN);       // the spawner and workers are reaped by the kernel
+    for (i = 0; i < MAX_HANDLER_WORKERS; i++)
+        dyn_pool.workers[i].fd = -1;
+    dyn_pool.epfd = epfd;
+    dyn_pool.trimmed = time(NULL);
+    dyn_pool.spawner = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0){
+        perror("Error creating handler socket");
+        return;
+    }
+    log_flush();                    // or the workers repeat our buffered lines
+    if ((pid = fork()) < 0){
+        perror("Error forking handler spawner");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0){
+        dyn_keep_channel(sv[1]);
+        dyn_spawner_main(DYN_CHANNEL_FD);
+    }
+    close(sv[1]);
+    dyn_pool.spawner = sv[0];
+    dyn_spawn();
+}
+
+/*
+ *    Queue c for the handler its path is routed to and return 1, or
+ *    return 0 if no prefix matches. The params and the body bytes
+ *    already in rio or a received ring buffer are packed into the BEGIN
+ *    message here, before the next request can be read over them.
+ */
+static int serve_dynamic(http_conn *c){
+    http_request *req = &c->req;
+    http_head *h = &c->head;
+    char params[DYN_PARAMS_MAX];
+    const char *path = req->filename + 1, *query;
+    size_t plen = 0, n;
+    dyn_record r = { DYN_VERSION, 0, 0 };
+    dyn_begin begin;
+    dyn_route *rt;
+    long long length = req->content_length;
+    char *p;
+    int i, j;
+
+    for (rt = dyn_routes; rt < dyn_routes + ndyn_routes; rt++)
+        if (strncmp(path, rt->prefix, rt->len) == 0)
+            break;
+    if (rt == dyn_routes + ndyn_routes)
+        return 0;
+    if (req->has_body && (req->chunked_body || length < 0)){
+        client_error(c, req->chunked_body ? 411 : 400, req->chunked_body ? "Length Required" : "Bad Request",
+                     "The request body needs a valid Content-Length.");
+        return 1;
+    }
+    if (req->has_body)
+        req->keep_alive = req->body_keep_alive;     // the worker reads exactly the body
+    query = memchr(h->url.p, '?', h->url.len);
+#define DYN_PARAM(name, len, value) if (plen < sizeof(params)) \
+    plen += snprintf(params + plen, sizeof(params) - plen, "%s%c%.*s%c", name, 0, (int)(len), value, 0)
+    DYN_PARAM("REQUEST_METHOD", h->method.len, h->method.p);
+    DYN_PARAM("REQUEST_URI", h->url.len, h->url.p);
+    n = rt->len - (rt->prefix[rt->len - 1] == '/');     // "/app/" is "/app" with a PATH_INFO of "/..."
+    DYN_PARAM("SCRIPT_NAME", n, rt->prefix);
+    DYN_PARAM("PATH_INFO", strlen(path + n), path + n);
+    DYN_PARAM("QUERY_STRING", query ? h->url.p + h->url.len - query - 1 : 0, query ? query + 1 : "");
+    DYN_PARAM("SERVER_PROTOCOL", h->version.len, h->version.p);
+    DYN_PARAM("REMOTE_ADDR", strlen(inet_ntoa(c->addr.sin_addr)), inet_ntoa(c->addr.sin_addr));
+    for (i = 0; i < h->num_headers && plen < sizeof(params); i++){
+        // the name uppercased with '-' as '_' after HTTP_, as CGI does, but for the body's
+        http_slice name = h->headers[i].name, value = h->headers[i].value;
+        char var[128] = "HTTP_";
+        int skip = slice_eq(name, "Content-Length") || slice_eq(name, "Content-Type") ? 5 : 0;
+        for (j = 0; j < (int)name.len && j < (int)sizeof(var) - 6; j++)
+            var[5 + j] = name.p[j] == '-' ? '_' : toupper((unsigned char)name.p[j]);
+        var[5 + j] = '\0';
+        DYN_PARAM(var + skip, value.len, value.p);
+    }
+#undef DYN_PARAM
+    if (plen >= sizeof(params)){
+        client_error(c, 431, "Request Header Fields Too Large", "Request head too large for the handler.");
+        return 1;
+    }
+    if (!req->has_body)
+        length = 0;
+    // BEGIN, PARAMS, then STDIN with at most what rio and a ring buffer hold
+    c->dyn_msg = malloc(3 * sizeof(r) + sizeof(begin) + plen + sizeof(c->rio.rio_buf) + 4096);
+    if ((p = c->dyn_msg) == NULL){
+        client_error(c, 500, "Internal Server Error", "Out of memory.");
+        return 1;
+    }
+    begin.handler = rt->handler;
+    begin.keep_alive = req->keep_alive && c->requests + 1 < config.max_requests;
+    begin.content_length = length;
+    r.type = DYN_BEGIN;
+    r.length = sizeof(begin);
+    memcpy(p, &r, sizeof(r));
+    memcpy(p += sizeof(r), &begin, sizeof(begin));
+    r.type = DYN_PARAMS;
+    r.length = plen;
+    memcpy(p += sizeof(begin), &r, sizeof(r));
+    memcpy(p += sizeof(r), params, plen);
+    p += plen;
+    r.type = DYN_STDIN;
+    r.length = 0;
+    while (1){
+        n = c->rio.rio_cnt;
+        if ((long long)n > length - r.length)
+            n = length - r.length;
+        memcpy(p + sizeof(r) + r.length, c->rio.rio_bufptr, n);
+        c->rio.rio_bufptr += n;
+        c->rio.rio_cnt -= n;
+        r.length += n;
+        // a ring buffer's bytes come after rio's; they're nowhere the worker can read
+        if (r.length == length || !c->ring_recv || c->ring_len == 0 || ring_fill(c) <= 0)
+            break;
+    }
+    memcpy(p, &r, sizeof(r));
+    c->dyn_msg_len = p + sizeof(r) + r.length - c->dyn_msg;
+    c->dyn_handler = rt->handler;
+    c->state = CONN_DYNAMIC;
+    if (config.mode == MODE_FORK){
+        // this child is the connection's own process already
+        dyn_end end;
+        dyn_serve(c->fd, c->dyn_msg, c->dyn_msg_len, &end);
+        free(c->dyn_msg);
+        c->dyn_msg = NULL;
+        c->status = end.status;
+        c->bytes_sent = end.bytes_sent;
+        c->req.keep_alive = end.keep_alive;
+        c->state = CONN_DONE;
+        return 1;
+    }
+    c->dyn_next = NULL;
+    if (dyn_pool.tail)
+        dyn_pool.tail->dyn_next = c;
+    else
+        dyn_pool.head = c;
+    dyn_pool.tail = c;
+    return 1;                       // dyn_dispatch() hands it to a worker
+}
+
+// send c's BEGIN message and socket to idle worker w
+static int dyn_send(dyn_worker *w, http_conn *c){
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { c->dyn_msg, c->dyn_msg_len };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &c->fd, sizeof(int));
+    // an idle worker's socket is empty, so the message goes whole or not at all
+    return sendmsg(w->fd, &msg, MSG_NOSIGNAL) == (ssize_t)c->dyn_msg_len ? 0 : -1;
+}
+
+// move c in the epoll set from socket from to socket to. It's only ever
+// in once, so one batch of events can't run it after it was closed
+static void dyn_watch(http_conn *c, int from, int to, uint32_t events){
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(dyn_pool.epfd, EPOLL_CTL_DEL, from, NULL) < 0 ||
+        epoll_ctl(dyn_pool.epfd, EPOLL_CTL_ADD, to, &ev) < 0)
+        perror("Error on epoll_ctl");
+}
+
+/*
+ *    Hand waiting requests to idle workers, forking more while requests
+ *    still wait, and retire workers long idle. Runs once per loop pass,
+ *    outside conn_run(), so no connection it wakes is being driven.
+ */
+static void uring_poll(http_conn *c, int fd, unsigned events);
+
+static void dyn_dispatch(void){
+    dyn_worker *w;
+    http_conn *c;
+    time_t now;
+    while ((c = dyn_pool.head) != NULL){
+        for (w = dyn_pool.workers; w < dyn_pool.workers + config.handler_workers; w++)
+            if (w->fd >= 0 && w->conn == NULL)
+                break;
+        if (w == dyn_pool.workers + config.handler_workers && (w = dyn_spawn()) == NULL)
+            break;                  // every worker busy; the rest wait for an END
+        if (dyn_send(w, c) < 0){
+            log_warn("handler worker %d is gone", w->pid);
+            dyn_retire(w);
+            continue;
+        }
+        if ((dyn_pool.head = c->dyn_next) == NULL)
+            dyn_pool.tail = NULL;
+        free(c->dyn_msg);
+        c->dyn_msg = NULL;
+        c->dyn = w;
+        w->conn = c;
+        w->end_len = 0;
+        // the END record wakes the connection
+        if (dyn_pool.epfd >= 0)
+            dyn_watch(c, c->fd, w->fd, EPOLLIN | EPOLLRDHUP | EPOLLET);
+        else
+            uring_poll(c, w->fd, POLLIN);
+    }
+    if (dyn_pool.head || (now = time(NULL)) - dyn_pool.trimmed < 1)
+        return;
+    dyn_pool.trimmed = now;
+    for (w = dyn_pool.workers; w < dyn_pool.workers + config.handler_workers && dyn_pool.nworkers > 1; w++)
+        if (w->fd >= 0 && w->conn == NULL && now - w->idle_since >= DYN_IDLE_SECONDS){
+            log_debug("handler worker %d idle, retiring it", w->pid);
+            dyn_retire(w);
+        }
+}
+
+// CONN_DYNAMIC: 1 once the worker's END record has handed c back, 0 while
+// it still has c, -1 if the worker died with it
+static int dyn_poll(http_conn *c){
+    dyn_worker *w = c->dyn;
+    dyn_record r;
+    dyn_end end;
+    ssize_t n;
+    if (w == NULL)
+        return 0;                   // still waiting for a worker
+    while (w->end_len < sizeof(w->end)){
+        if ((n = read(w->fd, w->end + w->end_len, sizeof(w->end) - w->end_len)) > 0){
+            w->end_len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        log_warn("handler worker %d died answering a request", w->pid);
+        dyn_retire(w);
+        c->dyn = NULL;
+        return -1;                  // closing c takes it out of the epoll set it isn't in
+    }
+    memcpy(&r, w->end, sizeof(r));
+    memcpy(&end, w->end + sizeof(r), sizeof(end));
+    if (dyn_pool.epfd >= 0)         // as accept_connections() registered it
+        dyn_watch(c, w->fd, c->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    w->conn = NULL;
+    w->idle_since = time(NULL);
+    c->dyn = NULL;
+    if (r.version != DYN_VERSION || r.type != DYN_END){
+        dyn_retire(w);
+        return -1;
+    }
+    c->status = end.status;
+    c->bytes_sent = end.bytes_sent;
+    c->req.keep_alive = end.keep_alive;
+    c->state = CONN_DONE;
+    return 1;
+}
+
+// stop or resume watching the listening socket; it is level-triggered, so
+// while paused it must leave the epoll set's interest or wake every pass
+static void set_accepting(int epfd, int listenfd, int on){
+    struct epoll_event ev;
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev) < 0)
+        perror("Error on epoll_ctl");
+}
+
+// epoll mode: serve every connection from this one process
+void run_event_loop(int listenfd){
+    struct epoll_event ev, events[MAX_EVENTS];
+    int epfd, n, i, inotify_fd, fs_fd, pool_done = 0;
+    uint64_t now, paused_at = 0;    // tick accepting paused on, 0 while accepting
+
+    if ((epfd = epoll_create1(0)) < 0 || set_nonblocking(listenfd) < 0){
+        perror("Error creating event loop");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;             // NULL marks the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0){
+        perror("Error on epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    // only long-lived processes keep a content cache; the fork model never fills one
+    if ((inotify_fd = file_cache_init()) >= 0){
+        ev.events = EPOLLIN;
+        ev.data.ptr = &file_cache;  // marks the cache's inotify descriptor
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0)
+            perror("Error on epoll_ctl");
+    }
+    docroot_index_watch(inotify_fd);
+    fd_cache_init();
+    dyn_pool_init(epfd);            // forks the spawner, so before the pool and log threads start
+    if ((fs_fd = fs_pool_init(config.io_threads)) >= 0){
+        ev.events = EPOLLIN;
+        ev.data.ptr = &fs_pool;     // marks the pool's completion eventfd
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fs_fd, &ev) < 0)
+            perror("Error on epoll_ctl");
+    }
+    access_log_init(1);
+    wheel.now = wheel_ticks();
+    while (1){
+        // with deadlines pending or accepts paused, wake every tick
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, wheel.count || paused_at ? TW_TICK_MS : -1)) < 0){
+            if (errno == EINTR)
+                continue;
+            perror("Error on epoll_wait");
             exit(EXIT_FAILURE);
         }
-        
-        while (!feof(fin)) {
-            fgets(buff, MAXLINE, fin);
-            if (num1 != num) {
-                strcpy(tmp2[num1], buff);
+        if (wheel.count == 0)
+            wheel.now = wheel_ticks();      // slept untimed, nothing to expire on the way
+        now = wheel.now;
+        for (i = 0; i < n; i++){
+            http_conn *c = events[i].data.ptr;
+            if (c == NULL){
+                if (accept_connections(epfd, listenfd) < 0){
+                    set_accepting(epfd, listenfd, 0);
+                    paused_at = wheel_ticks();
+                }
+            } else if (events[i].data.ptr == &file_cache){
+                file_cache_invalidate();
+            } else if (events[i].data.ptr == &fs_pool){
+                pool_done = 1;      // after the batch: it may hold events for the same connections
+            } else if (conn_run(c) < 0){
+                timer_cancel(c);
+                conn_close(c);      // close() also drops it from the epoll set
+            } else {
+                conn_arm_timer(c, now);
             }
-            num1++;
         }
-        fclose(fin);
-        fin = fopen(filename, "w+");
-        if (fin == NULL) {
-            perror("Cannot open the file");
-            exit(EXIT_FAILURE);
+        if (pool_done){
+            resume_pool_jobs(now);
+            pool_done = 0;
         }
-        for (int i = 0; i < 9; i++) {
-            fputs(tmp2[i], fin);
+        if (ndyn_routes)
+            dyn_dispatch();
+        expire_connections();
+        if (paused_at && wheel_ticks() > paused_at){
+            set_accepting(epfd, listenfd, 1);   // closes since then may have freed descriptors
+            paused_at = 0;
         }
-        uint len = strlen(tmp2[9]);
-        tmp2[9][len-1] = '\0';
-        fputs(tmp2[9], fin);
-        fclose(fin);
+        log_flush();                // one write for everything this pass logged
     }
 }
 
-// handle one HTTP request/response transaction
-void process(int fd, struct sockaddr_in *clientaddr){
+/*
+ *    io_uring backend (--mode=uring), driven through raw syscalls. One
+ *    ring per process stands in for epoll_wait() and the read() behind
+ *    every request: a multishot accept on the registered listening socket
+ *    hands over new connections, request bytes arrive as receive
+ *    completions in a ring of kernel-provided buffers and ring_fill()
+ *    copies them into rio, and a response that fills the socket waits on
+ *    a POLLOUT completion. Everything queued during a pass is submitted
+ *    together with the wait for the next completions, in one
+ *    io_uring_enter(). A connection has at most one operation
+ *    outstanding, recorded in ring_op; closing it with one in flight
+ *    cancels the operation and frees the connection once its completion
+ *    comes back. Kernels without provided buffer rings (before 5.19) run
+ *    the epoll loop instead.
+ */
+#define URING_ENTRIES 1024          // submission queue size; the completion queue is twice that
+#define URING_BUFS 1024             // provided receive buffers, a power of two
+#define URING_BUF_SIZE 4096
+#define URING_BGID 1                // buffer group the receive buffers are provided as
+
+// what a completion is for, in the low bits of its user_data; the rest is the connection
+enum { URING_ACCEPT = 1, URING_RECV, URING_POLL, URING_TIMEOUT, URING_INOTIFY, URING_CANCEL, URING_POOL };
+#define URING_TAG(ud) ((ud) & 7)
+#define URING_CONN(ud) ((http_conn *)(uintptr_t)((ud) & ~(uint64_t)7))
 
-    printf("accept request, fd is %d, pid is %d\n", fd, getpid());
-    http_request req;
-    parse_request(fd, &req );
+typedef struct {
+    int fd;                         // the ring, -1 if it could not be set up
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;   // provided buffer ring, shared with the kernel
+    char *bufs;                     // URING_BUFS buffers of URING_BUF_SIZE behind it
+    unsigned short br_tail;
+    int multishot;                  // one accept keeps completing; single-shot before 5.19
+    int accepting;                  // an accept is queued or still completing
+} uring;
 
-//    parse_request(fd, &req ,clientaddr);
+static uring ring = { .fd = -1 };
 
-    printf("I got in process, my fd is %d\n",fd);
-    
-    //
+// submit everything queued, optionally waiting for a completion.
+// the queue is the kernel's head to our tail, so an EINTR loses nothing
+static int uring_enter(int wait){
+    unsigned submit;
+    int n;
+    do {
+        submit = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        n = syscall(__NR_io_uring_enter, ring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
 
-    // get logs out
-    
-//    char temp_1[100];
-//    char temp_11[100];
-//    char line_1[100];
-//    memset(temp_1, 0, sizeof(temp_1));
-//    memset(temp_11, 0, sizeof(temp_11));
-//    memset(line_1,0,sizeof(line_1));
-//    FILE* f1 = fopen("recent_browser.txt", "rt+");
-//    int t1 = 0;
-//    while (fgets(temp_1,100,f1) != NULL && t1 <9) {
-//        strcat(temp_11,temp_1);
-//        t1++;
-//    }
-//    fclose(f1);
-//    FILE* f11 = fopen("recent_browser.txt", "w+	");
-//    sprintf(line_1,"%d",req.browser_index);   /*Add the recent browser info*/
-//    strcat(line_1,"\n");
-//    strcat(line_1, temp_11);
-//    fputs(line_1, f11);
-//    fclose(f11);
-//    printf ("The last 10 visited browsers: %s", line_1);
-//
-//    //  Get IP address in client addr and store it in  ip_address.txt
-//    char temp_2[100];
-//    char temp_22[100];
-//    char line_2[100];
-//    memset(temp_2,0, sizeof(temp_2));
-//    memset(temp_22,0, sizeof(temp_22));
-//    memset(line_2,0,sizeof(line_2));
-//    FILE* f2 = fopen("ip_address.txt", "rt+	");
-//    int t2 = 0;
-//    while (fgets(temp_2,100,f2) != NULL && t2 <9) {
-//        strcat(temp_22,temp_2);
-//        t2++;
-//    }
-//    fclose(f2);
-//    FILE* f22 = fopen("ip_address.txt", "w+	");
-//    char* ip_addr = inet_ntoa(clientaddr->sin_addr);
-//    strcpy(line_2, ip_addr);
-//    strcat(line_2, "\n");
-//    strcat(line_2, temp_22);
-//    fputs(line_2,f22);
-//    fclose(f22);
-//    printf("The correspoinding IP address: %s", line_2);
-//    
-    struct stat sbuf;
-    char * msg1 = "We haven't found what you requested.";
-    char *msg2 = "Unknown Error occured.";
-    int status = 200; //server status init as 200
-    int ffd = open(req.filename, O_RDONLY, 0);
-    printf("I am ready to get directory and static contents filename = %s \n",req.filename);
-    
-    if(ffd <= 0){
-        // detect 404 error and print error log
-        status = 404;
-        client_error(fd, status, "Not found", msg1);        /*Return format:  HTTP 1.1 404 Not found \n Content-length: %u \r\n\r\n;*/
-    } else {
-        // get descriptor status
-        fstat(ffd, &sbuf);
-        if(S_ISREG(sbuf.st_mode)){
-            // server serves static content
-            printf("I am fetching static");
-            serve_static(fd, ffd, &req, sbuf.st_size);
-        } else if(S_ISDIR(sbuf.st_mode)){
-            // server handle directory request
-            status = 200;
-            printf("I am fetching directory\n");
-            handle_directory_request(fd, ffd, req.filename);
-        } else {
-            // detect 400 error and print error log
-            status = 400;
-            client_error(fd, status, "Error", msg2);
+// queue a submission for op and return it to be filled in; nothing reads it
+// before the next io_uring_enter(), so it can be published straight away
+static struct io_uring_sqe *uring_get(int op, int fd, uint64_t user_data){
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= URING_ENTRIES &&
+        uring_enter(0) < 0){
+        perror("Error on io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// hand receive buffer bid back to the kernel
+static void uring_buf_recycle(int bid){
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+    b->addr = (uintptr_t)(ring.bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+// create the ring, map its queues, provide the receive buffers and register
+// the listening socket as fixed file 0. returns -1 with errno set if unsupported
+static int uring_setup(int listenfd){
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_len, cq_len;
+    char *sq;
+    int i, err;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)){
+        errno = ENOSYS;             // pre-5.5 kernel; epoll serves it better
+        goto fail;
+    }
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap(NULL, sq_len > cq_len ? sq_len : cq_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    ring.br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq == MAP_FAILED || ring.sqes == MAP_FAILED || ring.br == MAP_FAILED ||
+        (ring.bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL)
+        goto fail;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring.br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ||
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, &listenfd, 1) < 0)
+        goto fail;
+    for (i = 0; i < URING_BUFS; i++)
+        uring_buf_recycle(i);
+    ring.multishot = 1;             // provided buffer rings and multishot accept both arrived in 5.19
+    return 0;
+fail:
+    err = errno;
+    close(ring.fd);                 // the mappings are left to the epoll loop that takes over
+    ring.fd = -1;
+    errno = err;
+    return -1;
+}
+
+// accept on fixed file 0, the listening socket
+static void uring_accept(void){
+    struct io_uring_sqe *sqe = uring_get(IORING_OP_ACCEPT, 0, URING_ACCEPT);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (ring.multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    ring.accepting = 1;
+}
+
+// receive into whichever provided buffer the kernel picks
+static void uring_recv(http_conn *c){
+    struct io_uring_sqe *sqe;
+    c->ring_op = (uintptr_t)c | URING_RECV;
+    sqe = uring_get(IORING_OP_RECV, c->fd, c->ring_op);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->len = URING_BUF_SIZE;
+}
+
+// one-shot readiness wait on c's socket, for writes and for connections reading
+// with read(), or on the socket of the handler worker c is handed to
+static void uring_poll(http_conn *c, int fd, unsigned events){
+    c->ring_op = (uintptr_t)c | URING_POLL;
+    uring_get(IORING_OP_POLL_ADD, fd, c->ring_op)->poll32_events = events;
+}
+
+/*
+ *    The received bytes ring_fill() hands to the parser: as many of the
+ *    pending buffer's as fit in rio, the buffer going back to the kernel
+ *    once drained. Same results as rio_fill(), with EAGAIN meaning
+ *    another receive has to complete first.
+ */
+static ssize_t ring_fill(http_conn *c){
+    rio_t *rp = &c->rio;
+    size_t n;
+    if (c->ring_len == 0){
+        if (c->ring_eof)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (rp->rio_bufptr != rp->rio_buf){
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if ((n = sizeof(rp->rio_buf) - rp->rio_cnt) == 0){
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (n > c->ring_len)
+        n = c->ring_len;
+    memcpy(rp->rio_buf + rp->rio_cnt, c->ring_data, n);
+    rp->rio_cnt += n;
+    c->ring_data += n;
+    if ((c->ring_len -= n) == 0){
+        uring_buf_recycle(c->ring_buf);
+        c->ring_buf = -1;
+    }
+    return n;
+}
+
+// close a connection with no ring operation outstanding
+static void uring_close(http_conn *c){
+    if (c->ring_buf >= 0)
+        uring_buf_recycle(c->ring_buf);
+    timer_cancel(c);
+    conn_close(c);
+}
+
+// close c once the kernel is done with it: now, or when its cancelled operation completes
+static void uring_retire(http_conn *c){
+    if (c->ring_op == 0){
+        uring_close(c);
+        return;
+    }
+    uring_get(IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL)->addr = c->ring_op;
+    c->ring_closing = 1;
+}
+
+// run c as far as it goes, then queue the operation it is now waiting on
+static void uring_drive(http_conn *c){
+    if (conn_run(c) < 0){
+        uring_close(c);
+        return;
+    }
+    conn_arm_timer(c, wheel.now);
+    if (c->state == CONN_FS_WAIT)
+        return;                     // the pool's completion drives it next
+    if (c->state == CONN_DYNAMIC){
+        if (c->dyn)
+            uring_poll(c, c->dyn->fd, POLLIN);  // the rest of its END record
+        return;                     // else dyn_dispatch() queues that once a worker takes it
+    }
+    if (c->state != CONN_READ_REQUEST)
+        uring_poll(c, c->fd, POLLOUT);
+    else if (c->ring_recv)
+        uring_recv(c);
+    else
+        uring_poll(c, c->fd, POLLIN | POLLRDHUP);
+}
+
+// a connection the multishot accept handed over; the completion has no peer address
+static void uring_accepted(int fd){
+    struct sockaddr_in clientaddr;
+    socklen_t len = sizeof(clientaddr);
+    http_conn *c;
+    if (open_conns >= config.max_connections){
+        shed_connection(fd);
+        return;
+    }
+    if (getpeername(fd, (SA *)&clientaddr, &len) < 0)
+        memset(&clientaddr, 0, sizeof(clientaddr));
+    if ((c = conn_new(fd, &clientaddr)) == NULL){
+        close(fd);
+        return;
+    }
+    c->ring_recv = 1;
+    conn_arm_timer(c, wheel.now);
+    uring_recv(c);
+}
+
+// the completion of a connection's one outstanding operation
+static void uring_conn_complete(http_conn *c, int tag, int res, unsigned flags){
+    c->ring_op = 0;
+    if (tag == URING_RECV){
+        if (res > 0){
+            c->ring_buf = flags >> IORING_CQE_BUFFER_SHIFT;
+            c->ring_data = ring.bufs + (size_t)c->ring_buf * URING_BUF_SIZE;
+            c->ring_len = res;
+        } else if (res == 0){
+            c->ring_eof = 1;
+        } else if (res == -ENOBUFS){
+            c->ring_recv = 0;       // every buffer is parked; this one reads on readiness
+        } else if (res != -ECANCELED){
+            c->ring_closing = 1;
         }
-        close(ffd);
     }
-    // print log/status on the terminal
-    log_access(status, clientaddr, &req);
+    if (c->ring_closing)
+        uring_close(c);
+    else
+        uring_drive(c);
 }
 
-// main function:
-// get the user input for the file directory and port number
-int main(int argc, char** argv){
+// uring mode: serve every connection from this one process, falling back to epoll
+void run_uring_loop(int listenfd){
+    struct __kernel_timespec tick = { 0, TW_TICK_MS * 1000000LL };
+    struct io_uring_cqe *cqe;
+    uint64_t ud, paused_at = 0;     // tick accepting paused on, 0 while accepting
+    unsigned head, flags;
+    http_conn *c, *next;
+    int inotify_fd, fs_fd, res, timing = 0;
+
+    if (set_nonblocking(listenfd) < 0 || uring_setup(listenfd) < 0){
+        log_info("io_uring unavailable (%s), using epoll", strerror(errno));
+        config.mode = MODE_EPOLL;
+        run_event_loop(listenfd);
+        return;
+    }
+    if ((inotify_fd = file_cache_init()) >= 0)
+        uring_get(IORING_OP_POLL_ADD, inotify_fd, URING_INOTIFY)->poll32_events = POLLIN;
+    docroot_index_watch(inotify_fd);
+    fd_cache_init();
+    dyn_pool_init(-1);              // forks the spawner, so before the pool and log threads start
+    if ((fs_fd = fs_pool_init(config.io_threads)) >= 0)
+        uring_get(IORING_OP_POLL_ADD, fs_fd, URING_POOL)->poll32_events = POLLIN;
+    access_log_init(1);
+    wheel.now = wheel_ticks();
+    uring_accept();
+    while (1){
+        // with deadlines pending or accepts paused, wake every tick
+        if ((wheel.count || paused_at) && !timing){
+            struct io_uring_sqe *sqe = uring_get(IORING_OP_TIMEOUT, -1, URING_TIMEOUT);
+            sqe->addr = (uintptr_t)&tick;
+            sqe->len = 1;
+            timing = 1;
+        }
+        if (uring_enter(1) < 0){
+            perror("Error on io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        if (wheel.count == 0)
+            wheel.now = wheel_ticks();      // slept untimed, nothing to expire on the way
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)){
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            ud = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);  // handlers may queue more
+            switch (URING_TAG(ud)){
+            case URING_ACCEPT:
+                if (res >= 0){
+                    uring_accepted(res);
+                } else if (res == -EINVAL && ring.multishot){
+                    ring.multishot = 0;     // kernel without multishot accept
+                } else if (accept_exhausted(-res) && !paused_at){
+                    log_warn("accept: %s, shedding and pausing accepts", strerror(-res));
+                    shed_on_emfile(listenfd);
+                    paused_at = wheel_ticks();
+                    if (flags & IORING_CQE_F_MORE)
+                        uring_get(IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL)->addr = URING_ACCEPT;
+                } else if (res != -ECANCELED && res != -ECONNABORTED && res != -EINTR){
+                    log_error("accept: %s", strerror(-res));
+                }
+                if (!(flags & IORING_CQE_F_MORE)){
+                    ring.accepting = 0;
+                    if (!paused_at)
+                        uring_accept();
+                }
+                break;
+            case URING_RECV:
+            case URING_POLL:
+                uring_conn_complete(URING_CONN(ud), URING_TAG(ud), res, flags);
+                break;
+            case URING_TIMEOUT:
+                timing = 0;
+                break;
+            case URING_INOTIFY:
+                file_cache_invalidate();
+                uring_get(IORING_OP_POLL_ADD, inotify_fd, URING_INOTIFY)->poll32_events = POLLIN;
+                break;
+            case URING_POOL:
+                for (c = fs_completions(); c; c = next){
+                    next = c->fs_next;
+                    if (fs_finish(c) < 0)
+                        uring_close(c);
+                    else
+                        uring_drive(c);
+                }
+                uring_get(IORING_OP_POLL_ADD, fs_fd, URING_POOL)->poll32_events = POLLIN;
+                break;
+            }
+        }
+        if (ndyn_routes)
+            dyn_dispatch();
+        expire_connections();
+        if (paused_at && wheel_ticks() > paused_at){
+            paused_at = 0;          // closes since then may have freed descriptors
+            if (!ring.accepting)
+                uring_accept();
+        }
+        log_flush();                // one write for everything this pass logged
+    }
+}
+
+// fork mode: the original accept loop, one child per connection
+void run_fork_loop(int listenfd){
     struct sockaddr_in clientaddr;
-    int default_port = 9999,
-    listenfd,
-    connfd,
-    pid;
-    char buf[256];
     socklen_t clilent_size;
-    int status;
-    pid_t w;
-
-//    struct sigaction sa;
-//    sa.sa_handler = &handle_sigchld;
-//    sigemptyset(&sa.sa_mask);
-//    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-//    if (sigaction(SIGCHLD, &sa, 0) == -1) {
-//        perror(0);
-//        exit(1);
-//    }
-
-    listenfd = open_listenfd(default_port);
-    printf("Run main");
-    // get the name of the current working directory
-    // user input checking
-    // ignore SIGPIPE signal, so if browser cancels the request, it
-    // won't kill the whole process.
-    
-    signal(SIGPIPE, SIG_IGN);
+    int connfd, pid;
+    struct sigaction sa;
+    sigset_t chld, old;
+
+    sa.sa_handler = &handle_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sa, 0) == -1) {
+        perror(0);
+        exit(1);
+    }
+    access_log_init(0);             // children write their one line inline
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
     while(1){
         // permit an incoming connection attempt on a socket.
         clilent_size = sizeof(struct sockaddr_in);
-        connfd = accept(listenfd, (struct sockaddr_in*)&clientaddr, &clilent_size);
-        printf(" connfd = %d", connfd);
+        METRIC_START(t_accept);
+        connfd = accept4(listenfd, (SA *)&clientaddr, &clilent_size, SOCK_CLOEXEC);
+        log_debug("connfd = %d", connfd);
         if (connfd < 0) {
-            perror("Error on accepting here\n");
-            exit(EXIT_FAILURE);
+            // a transient failure must not take the server down
+            if (accept_exhausted(errno)){
+                log_warn("accept: %s, shedding and pausing accepts", strerror(errno));
+                shed_on_emfile(listenfd);
+                usleep(TW_TICK_MS * 1000);
+            } else if (errno != EINTR && errno != ECONNABORTED){
+                log_error("accept: %s", strerror(errno));
+            }
+            continue;
+        }
+        METRIC_PHASE(PHASE_ACCEPT, t_accept);   // blocking: includes the wait for a client
+        if (live_children >= config.max_connections){
+            shed_connection(connfd);
+            continue;
         }
         
         // fork children to handle parallel clients
+        log_flush();                // or every child repeats the parent's buffered lines
+        sigprocmask(SIG_BLOCK, &chld, &old);    // live_children++ can't race the handler
         pid = fork();
-        printf("run after fork pid = %d\n", pid);
+        if (pid > 0)
+            live_children++;
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        log_debug("run after fork pid = %d", pid);
         if (pid < 0){
             perror("Error on fork");
+            close(connfd);
         }
         else if (pid == 0) {
-            printf("Listen id = %d\n", listenfd);
             close(listenfd);
-            process(connfd, &clientaddr);
-            printf("connfd = %d is ready to exit",connfd);
+            handle_connection(connfd, &clientaddr);
+            log_debug("connfd = %d is ready to exit", connfd);
+            log_flush();
             exit(0);
         }
         else {
@@ -721,6 +6033,251 @@ int main(int argc, char** argv){
         }
         // handle one HTTP request/response transaction
     }
+}
+
+// serve on the configured port from the calling process
+void serve(int listenfd){
+    if (config.mode == MODE_FORK)
+        run_fork_loop(listenfd);
+    else if (config.mode == MODE_URING)
+        run_uring_loop(listenfd);
+    else
+        run_event_loop(listenfd);
+}
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int sig){
+    stop_requested = 1;
+}
+
+// body of one pre-spawned worker: pin to its core, open a private
+// SO_REUSEPORT listener and serve until killed
+void worker_main(int index, int cpu){
+    cpu_set_t set;
+    int listenfd;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);   // don't outlive the supervisor
+#ifndef NO_METRICS
+    metrics_use_slot(index);
+#endif
+    if (cpu >= 0){
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("Error pinning worker");
+    }
+    if ((listenfd = open_listenfd(config.port, 1)) < 0)
+        exit(EXIT_FAILURE);
+    serve(listenfd);
+    exit(0);
+}
+
+static pid_t spawn_worker(int index, int cpu){
+    pid_t pid;
+    fflush(stdout);                 // don't hand buffered output to the child
+    log_flush();
+    pid = fork();
+    if (pid < 0)
+        perror("Error on fork");
+    else if (pid == 0)
+        worker_main(index, cpu);
+    return pid;
+}
+
+// --workers mode: pre-spawn the workers, one per allowed core round-robin,
+// and restart any that die until SIGTERM/SIGINT
+void run_supervisor(void){
+    pid_t pids[MAX_WORKERS];
+    time_t started[MAX_WORKERS];
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    cpu_set_t allowed;
+    struct sigaction sa;
+    pid_t pid;
+    int i, status;
+
+    // pin only within the cores we were given (taskset, cgroups)
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &allowed))
+                cpus[ncpus++] = i;
+    }
+
+    sa.sa_handler = &handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;                // let waitpid() return EINTR
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    sa.sa_handler = &handle_sighup;     // forwarded so workers reopen their logs
+    sigaction(SIGHUP, &sa, 0);
+
+    for (i = 0; i < config.workers; i++){
+        pids[i] = spawn_worker(i, ncpus ? cpus[i % ncpus] : -1);
+        started[i] = time(NULL);
+    }
+
+    while (!stop_requested){
+        if ((pid = waitpid(-1, &status, 0)) < 0){
+            if (errno != EINTR){
+                perror("Error on waitpid");
+                break;
+            }
+            if (access_log_reopen){
+                access_log_reopen = 0;
+                for (i = 0; i < config.workers; i++)
+                    if (pids[i] > 0)
+                        kill(pids[i], SIGHUP);
+            }
+            continue;
+        }
+        for (i = 0; i < config.workers; i++){
+            if (pids[i] != pid)
+                continue;
+            log_warn("worker %d (pid %d) exited with status %d, restarting", i, pid, status);
+            if (time(NULL) - started[i] < 1)
+                sleep(1);           // don't spin on a worker that dies at startup
+            pids[i] = stop_requested ? -1 : spawn_worker(i, ncpus ? cpus[i % ncpus] : -1);
+            started[i] = time(NULL);
+            break;
+        }
+    }
+
+    for (i = 0; i < config.workers; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+}
+
+#ifndef TEST_SERVER_NO_MAIN     // bench.c includes this file for its helpers
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s [--port=N] [--mode=epoll|fork|uring] [--workers=N] [--cork=on|off]\n"
+            "       [--keepalive-timeout=SECONDS] [--header-timeout=SECONDS]\n"
+            "       [--send-timeout=SECONDS] [--max-requests=N]\n"
+            "       [--max-connections=N] [--max-inflight=N] [--io-threads=N]\n"
+            "       [--cache-size=MB] [--cache-max-file=KB]\n"
+            "       [--fd-cache=N] [--fd-cache-ttl=SECONDS]\n"
+            "       [--access-log=PATH] [--access-log-max=MB]\n"
+            "       [--log-level=debug|info|warn|error] [--compress-max-file=KB]\n"
+            "       [--mime-types=FILE] [--index=PATH] [--prewarm=N]\n"
+            "       [--handler=PREFIX=echo|lines]... [--handler-workers=N]\n", prog);
+    exit(EXIT_FAILURE);
+}
+// main function:
+// get the user input for the file directory and port number
+int main(int argc, char** argv){
+    int listenfd, i;
+
+    for (i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--port=", 7) == 0)
+            config.port = atoi(argv[i] + 7);
+        else if (strcmp(argv[i], "--mode=epoll") == 0)
+            config.mode = MODE_EPOLL;
+        else if (strcmp(argv[i], "--mode=fork") == 0)
+            config.mode = MODE_FORK;
+        else if (strcmp(argv[i], "--mode=uring") == 0)
+            config.mode = MODE_URING;
+        else if (strncmp(argv[i], "--workers=", 10) == 0)
+            config.workers = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "--cork=on") == 0)
+            config.cork = 1;
+        else if (strcmp(argv[i], "--cork=off") == 0)
+            config.cork = 0;
+        else if (strncmp(argv[i], "--keepalive-timeout=", 20) == 0)
+            config.keepalive_timeout = atoi(argv[i] + 20);
+        else if (strncmp(argv[i], "--header-timeout=", 17) == 0)
+            config.header_timeout = atoi(argv[i] + 17);
+        else if (strncmp(argv[i], "--send-timeout=", 15) == 0)
+            config.send_timeout = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--max-connections=", 18) == 0)
+            config.max_connections = atoi(argv[i] + 18);
+        else if (strncmp(argv[i], "--max-inflight=", 15) == 0)
+            config.max_inflight = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--io-threads=", 13) == 0)
+            config.io_threads = atoi(argv[i] + 13);
+        else if (strncmp(argv[i], "--index=", 8) == 0)
+            config.index_path = argv[i] + 8;
+        else if (strncmp(argv[i], "--prewarm=", 10) == 0)
+            config.prewarm = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--handler=", 10) == 0){
+            if (dyn_add_route(argv[i] + 10) < 0)
+                usage(argv[0]);
+        }
+        else if (strncmp(argv[i], "--handler-workers=", 18) == 0)
+            config.handler_workers = atoi(argv[i] + 18);
+        else if (strncmp(argv[i], "--max-requests=", 15) == 0)
+            config.max_requests = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+            config.cache_bytes = (size_t)atol(argv[i] + 13) << 20;
+        else if (strncmp(argv[i], "--cache-max-file=", 17) == 0)
+            config.cache_max_file = (size_t)atol(argv[i] + 17) << 10;
+        else if (strncmp(argv[i], "--fd-cache=", 11) == 0)
+            config.fd_cache_max = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--fd-cache-ttl=", 15) == 0)
+            config.fd_cache_ttl = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--access-log=", 13) == 0)
+            config.access_log = argv[i] + 13;
+        else if (strncmp(argv[i], "--access-log-max=", 17) == 0)
+            config.access_log_max = (size_t)atol(argv[i] + 17) << 20;
+        else if (strncmp(argv[i], "--mime-types=", 13) == 0)
+            config.mime_types = argv[i] + 13;
+        else if (strncmp(argv[i], "--compress-max-file=", 20) == 0)
+            config.compress_max_file = (size_t)atol(argv[i] + 20) << 10;
+        else if (strncmp(argv[i], "--log-level=", 12) == 0){
+            for (config.log_level = LOG_LEVEL_DEBUG; config.log_level <= LOG_LEVEL_ERROR; config.log_level++)
+                if (strcmp(argv[i] + 12, log_level_names[config.log_level]) == 0)
+                    break;
+            if (config.log_level > LOG_LEVEL_ERROR)
+                usage(argv[0]);
+        }
+        else
+            usage(argv[0]);
+    }
+    if (config.workers < 0 || config.workers > MAX_WORKERS ||
+        config.keepalive_timeout <= 0 || config.max_requests <= 0 ||
+        config.header_timeout <= 0 || config.send_timeout <= 0 ||
+        config.max_connections < 0 || config.max_inflight < 0 ||
+        config.io_threads < 0 || config.io_threads > MAX_IO_THREADS || config.prewarm < 0 ||
+        config.handler_workers <= 0 || config.handler_workers > MAX_HANDLER_WORKERS ||
+        config.fd_cache_max < 0 || config.fd_cache_ttl < 0)
+        usage(argv[0]);
+
+    log_info("serving port %d in %s mode, %d workers", config.port,
+             config.mode == MODE_FORK ? "fork" : config.mode == MODE_URING ? "uring" : "epoll",
+             config.workers);
+    // get the name of the current working directory
+    // user input checking
+    // ignore SIGPIPE signal, so if browser cancels the request, it
+    // won't kill the whole process.
+    
+    signal(SIGPIPE, SIG_IGN);
+    if (mime_types_init(config.mime_types) < 0)
+        exit(EXIT_FAILURE);
+    // requests resolve beneath the directory we were started in
+    if ((docroot_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0){
+        perror("Error opening the document root");
+        exit(EXIT_FAILURE);
+    }
+    // before any fork, so every worker maps the same index
+    if (config.index_path != NULL && docroot_index_build(config.index_path) == 0 && config.prewarm > 0)
+        docroot_index_prewarm(config.prewarm);
+    if (config.max_connections == 0)
+        config.max_connections = default_max_connections();
+    reserve_fd_open();              // each worker and the fork loop get their own copy
+    stats_init();                   // shared with every worker and child forked below
+#ifndef NO_METRICS
+    metrics_init(config.workers > 0 ? config.workers : 1);
+#endif
+    if (config.workers > 0){
+        run_supervisor();
+        return 0;
+    }
+    if ((listenfd = open_listenfd(config.port, 0)) < 0)
+        exit(EXIT_FAILURE);
+    serve(listenfd);
     close(listenfd);          /*Close listening socket*/
     return 0;
-}
\ No newline at end of file
+}
+#endif